@@ -0,0 +1,75 @@
+#ifndef TRM_APPROX_HPP_
+#define TRM_APPROX_HPP_
+
+#include "type.hpp"
+
+#include <cmath>
+
+namespace trm {
+// Cheaper versions of the math functions the nodes and the sampling use, for
+// renders that can afford small errors in the distances. `trm check`
+// measures what the errors given here add up to for the nodes of a scene.
+// Only the trigonometric functions are worth it: square roots, logarithms
+// and powers are single instructions or table driven code in the standard
+// library that polynomials of the same accuracy are slower than.
+namespace approx {
+  // sin and cos of x to 1e-7 for |x| below 1e4: x is reduced to
+  // [-pi/4, pi/4] by a multiple of pi/2 taken off in three parts, where the
+  // polynomials of Cephes' sinf and cosf apply.
+  inline void sincos(Float x, Float *s, Float *c) {
+    int q = static_cast<int>(x * 0.63661977f + (x < 0.0f ? -0.5f : 0.5f));
+    Float r = ((x - q * 1.5703125f) - q * 4.8375129699707031e-4f) -
+              q * 7.5497899548918821e-8f;
+    Float r2 = r * r;
+    Float sr =
+        r + r * r2 *
+                (-1.6666654611e-1f +
+                 r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+    Float cr = 1.0f - 0.5f * r2 +
+               r2 * r2 *
+                   (4.166664568298827e-2f +
+                    r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+    bool swap = (q & 1) != 0;
+    Float sq = swap ? cr : sr, cq = swap ? sr : cr;
+    *s = (q & 2) != 0 ? -sq : sq;
+    *c = ((q + 1) & 2) != 0 ? -cq : cq;
+  }
+  // atan2(y, x) to 3e-7 radians: the ratio of the smaller to the larger of
+  // |x| and |y| is reduced below tan(pi/8) for Cephes' atanf polynomial, and
+  // the octant is restored from the signs and the order of x and y.
+  inline Float atan2(Float y, Float x) {
+    Float ax = abs(x), ay = abs(y);
+    Float hi = max(ax, ay), lo = min(ax, ay);
+    Float t = hi > 0.0f ? lo / hi : 0.0f;
+    bool shift = t > 0.41421356f;
+    t = shift ? (t - 1.0f) / (t + 1.0f) : t;
+    Float t2 = t * t;
+    Float a = (shift ? 0.78539816f : 0.0f) + t +
+              t * t2 *
+                  (-3.33329491539e-1f +
+                   t2 * (1.99777106478e-1f +
+                         t2 * (-1.38776856032e-1f + t2 * 8.05374449538e-2f)));
+    a = ay > ax ? 1.57079633f - a : a;
+    a = x < 0.0f ? 3.14159265f - a : a;
+    return y < 0.0f ? -a : a;
+  }
+
+  // The functions nodes are evaluated with: the `Exact` ones of the standard
+  // library, or the `Fast` ones above.
+  struct Exact {
+    static inline void sincos(Float x, Float *s, Float *c) {
+      *s = std::sin(x);
+      *c = std::cos(x);
+    }
+    static inline Float atan2(Float y, Float x) { return std::atan2(y, x); }
+  };
+  struct Fast {
+    static inline void sincos(Float x, Float *s, Float *c) {
+      approx::sincos(x, s, c);
+    }
+    static inline Float atan2(Float y, Float x) { return approx::atan2(y, x); }
+  };
+} // namespace approx
+} // namespace trm
+
+#endif // TRM_APPROX_HPP_
@@ -31,11 +31,17 @@ bool trm::argparse::opt(const std::string &arg, glm::vec3 *value) {
                      &value->z) == 3;
 }
 bool trm::argparse::opt(const std::string &arg, std::string *value) {
-  char buf[255];
-  int result = std::sscanf(arg.c_str(), "%s", buf);
-  if (result != 1)
+  if (arg.size() == 0)
     return false;
-  *value = std::string(buf);
+  *value = arg;
+  return true;
+}
+bool trm::argparse::opt(const std::string &arg,
+                        std::vector<std::string> *value) {
+  std::string str;
+  if (!opt(arg, &str))
+    return false;
+  value->push_back(str);
   return true;
 }
 
@@ -75,6 +81,11 @@ trm::argparse::Parser::Argument::Argument(const std::string expr,
                                           std::string *ptr, std::string help)
     : type(STRING), ptr(reinterpret_cast<void *>(ptr)), expr(expr + ","),
       help(help) {}
+trm::argparse::Parser::Argument::Argument(const std::string expr,
+                                          std::vector<std::string> *ptr,
+                                          std::string help)
+    : type(STRINGS), ptr(reinterpret_cast<void *>(ptr)), expr(expr + ","),
+      help(help) {}
 
 int trm::argparse::Parser::Argument::parse_boolean(const std::string &arg) {
   *reinterpret_cast<bool *>(ptr) = true;
@@ -114,6 +125,10 @@ int trm::argparse::Parser::Argument::parse_opt(const std::string &str) {
     if (!opt(str, reinterpret_cast<std::string *>(ptr)))
       return -1;
     break;
+  case STRINGS:
+    if (!opt(str, reinterpret_cast<std::vector<std::string> *>(ptr)))
+      return -1;
+    break;
   default:
     return -1;
   }
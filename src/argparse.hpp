@@ -19,12 +19,24 @@ namespace argparse {
   bool opt(const std::string &arg, glm::uvec2 *value);
   bool opt(const std::string &arg, glm::uvec3 *value);
   bool opt(const std::string &arg, std::string *value);
+  bool opt(const std::string &arg, std::vector<std::string> *value);
 
   class Parser {
   public:
     class Argument {
     public:
-      enum Type { BOOL, INT, UINT, FLOAT, UVEC2, VEC2, UVEC3, VEC3, STRING };
+      enum Type {
+        BOOL,
+        INT,
+        UINT,
+        FLOAT,
+        UVEC2,
+        VEC2,
+        UVEC3,
+        VEC3,
+        STRING,
+        STRINGS
+      };
       Argument(const std::string expr, bool *ptr, std::string help);
       Argument(const std::string expr, int *ptr, std::string help);
       Argument(const std::string expr, std::size_t *ptr, std::string help);
@@ -34,6 +46,8 @@ namespace argparse {
       Argument(const std::string expr, glm::vec2 *ptr, std::string help);
       Argument(const std::string expr, glm::vec3 *ptr, std::string help);
       Argument(const std::string expr, std::string *ptr, std::string help);
+      Argument(const std::string expr, std::vector<std::string> *ptr,
+               std::string help);
 
       inline void print_help(const std::size_t width) const {
         std::printf("  %*s  %s\n", static_cast<int>(width),
@@ -60,13 +74,17 @@ namespace argparse {
           prev = pos + 1;
           if (arg.compare(0, matcher.size(), matcher) == 0) {
             if (type == BOOL) {
+              // Long flags must match exactly, so "--farm" does not swallow
+              // "--farm-tiles".
+              if (matcher[1] == '-' && arg.size() != matcher.size())
+                continue;
               return parse_boolean(matcher);
             } else if (arg.size() > matcher.size() &&
                        arg[matcher.size()] == '=') {
               return parse_opt(arg.substr(matcher.size() + 1)) == -1
                          ? -1
                          : arg.size();
-            } else {
+            } else if (arg.size() == matcher.size()) {
               return arg.size() + parse_opt(peek);
             }
           }
@@ -115,7 +133,8 @@ namespace argparse {
             matched = true;
             chars -= cargs[0].size();
             cargs.erase(cargs.begin());
-            if (chars == static_cast<int>(cargs[0].size())) {
+            if (cargs.size() != 0 &&
+                chars == static_cast<int>(cargs[0].size())) {
               cargs.erase(cargs.begin());
             }
             break;
@@ -136,7 +155,8 @@ namespace argparse {
           } else if (chars >= static_cast<int>(cargs[0].size())) {
             chars -= cargs[0].size();
             cargs.erase(cargs.begin());
-            if (chars == static_cast<int>(cargs[0].size())) {
+            if (cargs.size() != 0 &&
+                chars == static_cast<int>(cargs[0].size())) {
               cargs.erase(cargs.begin());
             }
             break;
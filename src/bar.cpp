@@ -164,7 +164,7 @@ void ProgressBar::next(std::size_t i) {
 }
 void ProgressBar::display() {
   std::string elapsed_str = format_interval(elapsed);
-  float rate = n / elapsed;
+  float rate = (n - initial) / elapsed;
   float inv_rate = 1 / rate;
   std::string rate_noinv_str =
       (unit_scale ? format_sizeof(rate) : fmt::format("{:5.2f}", rate)) + unit +
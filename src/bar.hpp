@@ -31,6 +31,8 @@ public:
   void finish();
 
   std::size_t n, total;
+  // Part of `n` that was done before the bar started, left out of the rate.
+  std::size_t initial = 0;
   float elapsed = 0.0f;
   std::chrono::system_clock::time_point tp;
 
@@ -0,0 +1,234 @@
+#include "check.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "approx.hpp"
+#include "kernel.hpp"
+#include "rand.hpp"
+#include "scene.hpp"
+#include "sdf.hpp"
+#include "type.hpp"
+
+namespace {
+// Radius of the ball around the origin that unbounded nodes and objects are
+// sampled in.
+const Float unbounded_radius = 4.0f;
+
+struct Errors {
+  Errors() : count(0), points(0), max(0.0), sum(0.0) {}
+  void add(Float exact, Float fast, Float scale) {
+    if (!std::isfinite(exact) || !std::isfinite(fast))
+      return;
+    double error = std::abs(double(fast) - double(exact)) / scale;
+    max = error > max ? error : max;
+    sum += error;
+    ++points;
+  }
+  std::size_t count, points;
+  double max, sum;
+};
+
+const char *kind_name(trm::SdfKind kind) {
+  switch (kind) {
+  case trm::SdfKind::Sphere:
+    return "sphere";
+  case trm::SdfKind::Box:
+    return "box";
+  case trm::SdfKind::Cylinder:
+    return "cylinder";
+  case trm::SdfKind::Torus:
+    return "torus";
+  case trm::SdfKind::Plane:
+    return "plane";
+  case trm::SdfKind::Pyramid:
+    return "pyramid";
+  case trm::SdfKind::MengerSponge:
+    return "mengerSponge";
+  case trm::SdfKind::SerpinskiTetrahedron:
+    return "serpinskiTetrahedron";
+  case trm::SdfKind::Kifs:
+    return "kifs";
+  case trm::SdfKind::Mandelbulb:
+    return "mandelbulb";
+  case trm::SdfKind::Mandelbox:
+    return "mandelbox";
+  case trm::SdfKind::Elongate:
+    return "elongate";
+  case trm::SdfKind::Round:
+    return "round";
+  case trm::SdfKind::Onion:
+    return "onion";
+  case trm::SdfKind::Union:
+    return "union";
+  case trm::SdfKind::Subtraction:
+    return "subtraction";
+  case trm::SdfKind::Intersection:
+    return "intersection";
+  case trm::SdfKind::SmoothUnion:
+    return "smoothUnion";
+  case trm::SdfKind::SmoothSubtraction:
+    return "smoothSubtraction";
+  case trm::SdfKind::SmoothIntersection:
+    return "smoothIntersection";
+  case trm::SdfKind::Repeat:
+    return "repeat";
+  case trm::SdfKind::LimitedRepeat:
+    return "limitedRepeat";
+  case trm::SdfKind::Mirror:
+    return "mirror";
+  case trm::SdfKind::PolarRepeat:
+    return "polarRepeat";
+  case trm::SdfKind::Instance:
+    return "instance";
+  case trm::SdfKind::MultiUnion:
+    return "multiUnion";
+  }
+  return "unknown";
+}
+
+void collect(trm::Sdf *node, std::set<trm::Sdf *> *seen) {
+  if (node == nullptr || !seen->insert(node).second)
+    return;
+  for (auto &child : trm::child_slots(node))
+    collect(child->get(), seen);
+}
+
+bool approximated(const trm::Sdf &node) {
+  return trm::kernel::entry(node.kind(), true) !=
+         trm::kernel::entry(node.kind(), false);
+}
+
+// Gives every node the kernels with the approximations or without, and
+// invalidates the values memoized with the others.
+void rebind(const std::set<trm::Sdf *> &nodes, bool fast,
+          const std::vector<std::shared_ptr<trm::Sdf>> &objects) {
+  for (trm::Sdf *node : nodes)
+    node->kernel = trm::kernel::entry(node->kind(), fast);
+  trm::memoize_shared(objects);
+}
+
+Vec3 in_ball(trm::Rng *rng, const Vec3 &center, Float radius) {
+  std::uniform_real_distribution<Float> u(-1.0f, 1.0f);
+  Vec3 d;
+  do {
+    d.x = u(*rng);
+    d.y = u(*rng);
+    d.z = u(*rng);
+  } while (dot(d, d) > 1.0f);
+  return center + radius * d;
+}
+
+void print_row(const char *name, const Errors &errors, Float tolerance) {
+  std::printf("  %-22s %6lu  %10.3g  %10.3g  %s\n", name, errors.count,
+              errors.max, errors.points != 0 ? errors.sum / errors.points : 0.0,
+              errors.max <= tolerance ? "ok" : "FAIL");
+}
+} // namespace
+
+bool trm::check::fast_math(Scene *scene, Float tolerance,
+                           std::size_t samples) {
+  std::set<Sdf *> nodes;
+  for (auto &obj : scene->objects)
+    collect(obj.get(), &nodes);
+
+  // Each node on its own, in its own frame, with its children evaluated the
+  // same way both times. Lengths in the frame of the node are at least
+  // `lod_scale` times those of the scene.
+  Rng rng(1);
+  std::map<SdfKind, Errors> kinds;
+  for (Sdf *node : nodes) {
+    if (!approximated(*node))
+      continue;
+    bool bounded = std::isfinite(node->bound_radius);
+    Vec3 center = bounded ? node->bound_center : Vec3(0.0f);
+    Float radius = bounded ? 1.5f * node->bound_radius / node->bound_scale
+                           : unbounded_radius;
+    Float scale = std::isfinite(node->lod_scale) && node->lod_scale > 0.0f
+                      ? node->lod_scale
+                      : 1.0f;
+    const kernel::Entry *exact = kernel::entry(node->kind(), false);
+    const kernel::Entry *fast = kernel::entry(node->kind(), true);
+    Errors &errors = kinds[node->kind()];
+    ++errors.count;
+    for (std::size_t i = 0; i < samples; ++i) {
+      Vec3 p = in_ball(&rng, center, radius);
+      errors.add(exact->dist(*node, p), fast->dist(*node, p), scale);
+    }
+  }
+
+  // Whole objects, where the errors of their nodes add up.
+  std::vector<const Sdf *> objects;
+  for (auto &obj : scene->objects) {
+    std::set<Sdf *> reached;
+    collect(obj.get(), &reached);
+    for (Sdf *node : reached) {
+      if (obj->mat != nullptr && approximated(*node)) {
+        objects.push_back(obj.get());
+        break;
+      }
+    }
+  }
+  std::vector<Vec3> points;
+  std::vector<Float> values;
+  rebind(nodes, false, scene->objects);
+  for (const Sdf *obj : objects) {
+    Vec3 center;
+    Float radius;
+    enclosing_sphere(*obj, &center, &radius);
+    if (!std::isfinite(radius)) {
+      center = Vec3(0.0f);
+      radius = unbounded_radius;
+    } else {
+      radius *= 1.5f;
+    }
+    for (std::size_t i = 0; i < samples; ++i) {
+      points.push_back(in_ball(&rng, center, radius));
+      values.push_back((*obj)(points.back()));
+    }
+  }
+  rebind(nodes, true, scene->objects);
+  Errors whole;
+  whole.count = objects.size();
+  for (std::size_t i = 0; i < points.size(); ++i)
+    whole.add(values[i], (*objects[i / samples])(points[i]), 1.0f);
+  for (Sdf *node : nodes)
+    node->kernel = kernel::entry(node->kind());
+  memoize_shared(scene->objects);
+
+  // Directions of the hemisphere sampling, for a unit radius.
+  Errors directions;
+  std::uniform_real_distribution<Float> u(0.0f, 1.0f);
+  for (std::size_t i = 0; i < samples; ++i) {
+    Float phi = 2.0f * Float(M_PI) * u(rng), s, c;
+    approx::sincos(phi, &s, &c);
+    Vec2 exact(std::cos(phi), std::sin(phi));
+    directions.add(0.0f, length(Vec2(c, s) - exact), 1.0f);
+  }
+
+  std::printf("Fast math in \"%s\", %lu points each, tolerance %g:\n",
+              scene->source.c_str(), samples, tolerance);
+  std::printf("  %-22s %6s  %10s  %10s\n", "Node", "Count", "Max error",
+              "Mean error");
+  bool ok = true;
+  for (auto &kind : kinds) {
+    print_row(kind_name(kind.first), kind.second, tolerance);
+    ok = ok && kind.second.max <= tolerance;
+  }
+  if (kinds.empty()) {
+    std::printf("  (no node of the scene has approximations)\n");
+  } else {
+    print_row("objects", whole, tolerance);
+    ok = ok && whole.max <= tolerance;
+  }
+  std::printf("  %-22s %6s  %10.3g  %10.3g  (radians)\n", "directions", "-",
+              directions.max,
+              directions.points != 0 ? directions.sum / directions.points
+                                     : 0.0);
+  return ok;
+}
@@ -0,0 +1,21 @@
+#ifndef TRM_CHECK_HPP_
+#define TRM_CHECK_HPP_
+
+#include <cstddef>
+
+#include "scene.hpp"
+#include "type.hpp"
+
+namespace trm {
+namespace check {
+  // Compares the kernels with the approximations of approx.hpp to the exact
+  // ones at `samples` random points around every node that has them, and
+  // around every object with such a node, and prints the largest errors per
+  // kind of node in the units of the scene. The sampling directions are
+  // compared the same way. Nodes are bound to the exact kernels again
+  // afterwards. Returns whether no distance is off by more than `tolerance`.
+  bool fast_math(Scene *scene, Float tolerance, std::size_t samples);
+} // namespace check
+} // namespace trm
+
+#endif // TRM_CHECK_HPP_
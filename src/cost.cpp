@@ -0,0 +1,109 @@
+#include "cost.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include "farm.hpp"
+#include "prof.hpp"
+#include "type.hpp"
+
+namespace {
+struct CostedTile {
+  trm::farm::Tile tile;
+  float cost;
+  bool operator<(const CostedTile &other) const { return cost < other.cost; }
+};
+} // namespace
+
+float trm::cost::CostMap::total() const {
+  float sum = 0.0f;
+  for (auto &s : steps)
+    sum += s;
+  return sum;
+}
+
+float trm::cost::CostMap::cost(const farm::Tile &tile) const {
+  // Each full resolution pixel is charged the cost of the pre-pass pixel it
+  // falls in.
+  float sum = 0.0f;
+  for (unsigned y = tile.y0; y < tile.y1; ++y) {
+    const float *row = steps.data() + std::min(y / scale, res.y - 1) * res.x;
+    unsigned x = tile.x0;
+    while (x < tile.x1) {
+      unsigned cx = std::min(x / scale, res.x - 1);
+      unsigned next = (cx == res.x - 1) ? tile.x1 : (cx + 1) * scale;
+      next = std::min(next, tile.x1);
+      sum += row[cx] * (next - x);
+      x = next;
+    }
+  }
+  return sum;
+}
+
+double trm::cost::CostMap::estimate(const uvec2 &full_res,
+                                    const std::size_t &spp) const {
+  double samples = static_cast<double>(res.x) * res.y;
+  return seconds * (static_cast<double>(full_res.x) * full_res.y * spp) /
+         samples;
+}
+
+std::vector<trm::farm::Tile> trm::cost::partition(const CostMap &map,
+                                                  const uvec2 &res,
+                                                  std::size_t count,
+                                                  unsigned min_size) {
+  PROF_FUNC("cost", "count", count);
+  std::priority_queue<CostedTile> queue;
+  std::vector<CostedTile> leaves;
+  farm::Tile full{0, 0, res.x, res.y};
+  queue.push({full, map.cost(full)});
+  while (!queue.empty() && queue.size() + leaves.size() < count) {
+    CostedTile top = queue.top();
+    queue.pop();
+    farm::Tile &t = top.tile;
+    bool split_x = (t.x1 - t.x0) >= (t.y1 - t.y0);
+    unsigned lo = split_x ? t.x0 : t.y0, hi = split_x ? t.x1 : t.y1;
+    if (hi - lo < 2 * min_size) {
+      split_x = !split_x;
+      lo = split_x ? t.x0 : t.y0;
+      hi = split_x ? t.x1 : t.y1;
+    }
+    if (hi - lo < 2 * min_size) {
+      leaves.push_back(top);
+      continue;
+    }
+    // Bisect on cost rather than area, so both halves are equally expensive.
+    unsigned best = lo + min_size;
+    float half = top.cost / 2.0f, acc = 0.0f;
+    for (unsigned s = lo; s < hi - min_size; ++s) {
+      farm::Tile slab = split_x ? farm::Tile{s, t.y0, s + 1, t.y1}
+                                : farm::Tile{t.x0, s, t.x1, s + 1};
+      acc += map.cost(slab);
+      if (acc >= half) {
+        best = std::max(s + 1, lo + min_size);
+        break;
+      }
+      best = s + 1;
+    }
+    farm::Tile a = t, b = t;
+    if (split_x) {
+      a.x1 = b.x0 = best;
+    } else {
+      a.y1 = b.y0 = best;
+    }
+    queue.push({a, map.cost(a)});
+    queue.push({b, map.cost(b)});
+  }
+  while (!queue.empty()) {
+    leaves.push_back(queue.top());
+    queue.pop();
+  }
+  std::sort(leaves.begin(), leaves.end(),
+            [](const CostedTile &a, const CostedTile &b) {
+              return a.cost > b.cost;
+            });
+  std::vector<farm::Tile> tiles;
+  for (auto &leaf : leaves)
+    tiles.push_back(leaf.tile);
+  return tiles;
+}
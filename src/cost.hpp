@@ -0,0 +1,35 @@
+#ifndef TRM_COST_HPP_
+#define TRM_COST_HPP_
+
+#include <vector>
+
+#include "farm.hpp"
+#include "type.hpp"
+
+namespace trm {
+namespace cost {
+  // Ray march steps per pixel measured by a low resolution, single sample
+  // pre-pass over the full image.
+  struct CostMap {
+    uvec2 res;
+    unsigned scale;
+    std::vector<float> steps;
+    double seconds;
+
+    float total() const;
+    // Summed cost of a full resolution tile.
+    float cost(const farm::Tile &tile) const;
+    // Wall clock estimate for rendering `res` at `spp` samples per pixel.
+    double estimate(const uvec2 &full_res, const std::size_t &spp) const;
+  };
+
+  // Splits the image into roughly `count` tiles of equal cost by recursively
+  // halving the most expensive tile along its longer axis, so expensive
+  // regions get small tiles. Tiles are returned most expensive first.
+  std::vector<farm::Tile> partition(const CostMap &map, const uvec2 &res,
+                                    std::size_t count,
+                                    unsigned min_size = 8);
+} // namespace cost
+} // namespace trm
+
+#endif // TRM_COST_HPP_
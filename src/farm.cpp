@@ -0,0 +1,491 @@
+#include "farm.hpp"
+
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "camera.hpp"
+#include "scene.hpp"
+#include "img.hpp"
+#include "kernel.hpp"
+#include "prof.hpp"
+#include "settings.hpp"
+#include "type.hpp"
+
+#define PARTIAL_MAGIC 0x504d5254u // "TRMP"
+
+// Seconds between the updates of the time of a claim while its tile renders,
+// which the coordinator measures --farm-timeout from.
+#define HEARTBEAT_INTERVAL 1
+
+namespace {
+struct Job {
+  trm::farm::Tile tile;
+  std::size_t attempts;
+  bool done;
+};
+
+std::string job_name(const std::size_t &id) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "tile-%06lu", id);
+  return buf;
+}
+std::string host_name() {
+  char buf[256] = {0};
+  if (gethostname(buf, sizeof(buf) - 1) != 0)
+    return "localhost";
+  for (char *c = buf; *c; ++c) {
+    if (*c == '.')
+      *c = '_';
+  }
+  return buf;
+}
+std::vector<std::string> list_dir(const std::string &dir) {
+  std::vector<std::string> entries;
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr)
+    return entries;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != nullptr) {
+    if (ent->d_name[0] != '.')
+      entries.push_back(ent->d_name);
+  }
+  closedir(d);
+  return entries;
+}
+bool ends_with(const std::string &str, const std::string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), std::string::npos, suffix) ==
+             0;
+}
+
+bool write_tile(const std::string &path, const trm::farm::Tile &tile,
+                const trm::Film &film) {
+  std::string tmp = path + ".tmp";
+  FILE *out = std::fopen(tmp.c_str(), "wb");
+  if (out == nullptr)
+    return false;
+  uint32_t header[5] = {PARTIAL_MAGIC, tile.x0, tile.y0, tile.x1, tile.y1};
+  bool ok = std::fwrite(header, sizeof(header), 1, out) == 1 &&
+            std::fwrite(film.rgb.get(), sizeof(float) * 3, tile.size(),
+                        out) == tile.size() &&
+            std::fwrite(film.samples.get(), sizeof(uint32_t), tile.size(),
+                        out) == tile.size();
+  ok = (std::fclose(out) == 0) && ok;
+  return ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+// Reads a partial result into a tile sized film, then adds it to `film`.
+bool read_tile(const std::string &path, const trm::farm::Tile &tile,
+               trm::Film *film) {
+  FILE *in = std::fopen(path.c_str(), "rb");
+  if (in == nullptr)
+    return false;
+  uint32_t header[5];
+  trm::Film part(uvec2(tile.x1 - tile.x0, tile.y1 - tile.y0));
+  bool ok = std::fread(header, sizeof(header), 1, in) == 1 &&
+            header[0] == PARTIAL_MAGIC && header[1] == tile.x0 &&
+            header[2] == tile.y0 && header[3] == tile.x1 &&
+            header[4] == tile.y1 &&
+            std::fread(part.rgb.get(), sizeof(float) * 3, tile.size(), in) ==
+                tile.size() &&
+            std::fread(part.samples.get(), sizeof(uint32_t), tile.size(),
+                       in) == tile.size();
+  std::fclose(in);
+  if (!ok)
+    return false;
+  film->add(part, tile.x0, tile.y0);
+  return true;
+}
+
+// Sets the time of a claim to now, right away and then every
+// HEARTBEAT_INTERVAL seconds until destroyed, so that the coordinator can tell
+// a worker rendering a long tile from one that is gone.
+class Heartbeat {
+public:
+  explicit Heartbeat(const std::string &claim) : claim_(claim), stop_(false) {
+    utime(claim_.c_str(), nullptr);
+    thread_ = std::thread(&Heartbeat::run, this);
+  }
+  ~Heartbeat() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+  }
+  Heartbeat(const Heartbeat &) = delete;
+  Heartbeat &operator=(const Heartbeat &) = delete;
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cond_.wait_for(lock, std::chrono::seconds(HEARTBEAT_INTERVAL),
+                           [this] { return stop_; }))
+      utime(claim_.c_str(), nullptr);
+  }
+
+  std::string claim_;
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+
+// The coordinator's other threads may hold the allocator's or stdio's locks
+// at the fork, so everything the child needs is made before it, and the
+// child only execs or exits.
+pid_t spawn(const std::vector<std::string> &argv, const std::string &spool) {
+  std::vector<char *> args;
+  for (auto &arg : argv)
+    args.push_back(const_cast<char *>(arg.c_str()));
+  args.push_back(const_cast<char *>("--worker"));
+  args.push_back(const_cast<char *>(spool.c_str()));
+  args.push_back(nullptr);
+  std::string error = "Failed to launch worker \"" + argv[0] + "\"\n";
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  execv("/proc/self/exe", args.data());
+  execvp(args[0], args.data());
+  ssize_t written = write(STDERR_FILENO, error.data(), error.size());
+  (void)written;
+  _exit(127);
+}
+} // namespace
+
+std::vector<trm::farm::Tile> trm::farm::split(const uvec2 &res,
+                                              std::size_t count) {
+  count = std::max<std::size_t>(1, std::min<std::size_t>(count, res.y));
+  std::vector<Tile> tiles;
+  for (std::size_t i = 0; i < count; ++i) {
+    unsigned y0 = static_cast<unsigned>(i * res.y / count);
+    unsigned y1 = static_cast<unsigned>((i + 1) * res.y / count);
+    tiles.push_back({0, y0, res.x, y1});
+  }
+  return tiles;
+}
+
+bool trm::farm::read_manifest(const std::string &spool,
+                              RenderSettings *settings, Scene *scene) {
+  Camera *camera = &scene->camera;
+  FILE *in = std::fopen((spool + "/manifest").c_str(), "r");
+  if (in == nullptr) {
+    std::fprintf(stderr, "Failed to read farm manifest in \"%s\"\n",
+                 spool.c_str());
+    return false;
+  }
+  char key[64];
+  while (std::fscanf(in, "%63s", key) == 1) {
+    std::string k(key);
+    if (k == "seed") {
+      std::fscanf(in, "%lu", &settings->seed);
+    } else if (k == "resolution") {
+      std::fscanf(in, "%u %u", &settings->resolution.x,
+                  &settings->resolution.y);
+    } else if (k == "spp") {
+      std::fscanf(in, "%lu", &settings->spp);
+    } else if (k == "maximumDepth") {
+      std::fscanf(in, "%lu", &settings->maximum_depth);
+    } else if (k == "maximumDistance") {
+      std::fscanf(in, "%a", &settings->maximum_distance);
+    } else if (k == "epsilonDistance") {
+      std::fscanf(in, "%a", &settings->epsilon_distance);
+    } else if (k == "optimize") {
+      int optimize = 0;
+      std::fscanf(in, "%d", &optimize);
+      settings->optimize = optimize != 0;
+    } else if (k == "segment") {
+      int segment = 0;
+      std::fscanf(in, "%d", &segment);
+      settings->segment_tracing = segment != 0;
+    } else if (k == "analytic") {
+      int analytic = 0;
+      std::fscanf(in, "%d", &analytic);
+      settings->analytic = analytic != 0;
+    } else if (k == "refine") {
+      std::fscanf(in, "%lu", &settings->refine_steps);
+    } else if (k == "lod") {
+      std::fscanf(in, "%a", &settings->lod);
+    } else if (k == "kernels") {
+      char name[32] = "";
+      std::fscanf(in, "%31s", name);
+      kernel::Isa isa;
+      if (!kernel::parse_isa(name, &isa) ||
+          !kernel::select(kernel::equivalent(isa))) {
+        std::fprintf(stderr,
+                     "ERROR: This CPU can not match the %s kernels of the "
+                     "farm render\n",
+                     name);
+        std::fclose(in);
+        return false;
+      }
+    } else if (k == "fastMath") {
+      int fast = 0;
+      std::fscanf(in, "%d", &fast);
+      settings->fast_math = fast != 0;
+      kernel::set_fast_math(settings->fast_math);
+    } else if (k == "fov") {
+      std::fscanf(in, "%a", &camera->fov);
+    } else if (k == "pos") {
+      std::fscanf(in, "%a %a %a", &camera->pos.x, &camera->pos.y,
+                  &camera->pos.z);
+    } else if (k == "center") {
+      std::fscanf(in, "%a %a %a", &camera->center.x, &camera->center.y,
+                  &camera->center.z);
+    } else if (k == "up") {
+      std::fscanf(in, "%a %a %a", &camera->up.x, &camera->up.y,
+                  &camera->up.z);
+    } else if (k == "scene") {
+      char path[4096];
+      if (std::fscanf(in, " %4095[^\n]", path) == 1)
+        scene->source = path;
+    }
+  }
+  std::fclose(in);
+  return true;
+}
+
+bool trm::farm::work(const std::string &spool, const TileRenderer &render) {
+  PROF_FUNC("farm", "spool", spool);
+  std::string claim_suffix =
+      "." + host_name() + "." + std::to_string(getpid()) + ".claim";
+  while (true) {
+    std::vector<std::string> entries = list_dir(spool);
+    std::set<std::string> jobs;
+    for (auto &entry : entries) {
+      if (ends_with(entry, ".job"))
+        jobs.insert(entry.substr(0, entry.size() - 4));
+    }
+    if (jobs.size() == 0)
+      return true;
+    for (auto &job : jobs) {
+      std::string claim = spool + "/" + job + claim_suffix;
+      if (std::rename((spool + "/" + job + ".job").c_str(), claim.c_str()) !=
+          0)
+        continue;
+      // The rename keeps the time the job was written at.
+      Heartbeat heartbeat(claim);
+      FILE *in = std::fopen(claim.c_str(), "r");
+      Tile tile;
+      bool ok = in != nullptr && std::fscanf(in, "%u %u %u %u", &tile.x0,
+                                             &tile.y0, &tile.x1,
+                                             &tile.y1) == 4;
+      if (in != nullptr)
+        std::fclose(in);
+      if (!ok) {
+        std::fprintf(stderr, "Malformed job \"%s\"\n", claim.c_str());
+        return false;
+      }
+      Film film(uvec2(tile.x1 - tile.x0, tile.y1 - tile.y0));
+      render(tile, &film);
+      if (!write_tile(spool + "/" + job + ".part", tile, film)) {
+        std::fprintf(stderr, "Failed to write \"%s/%s.part\"\n", spool.c_str(),
+                     job.c_str());
+        return false;
+      }
+      std::remove(claim.c_str());
+    }
+  }
+}
+
+bool trm::farm::coordinate(const std::string &spool,
+                           const std::vector<Tile> &tiles,
+                           const RenderSettings &settings,
+                           const Scene &scene,
+                           const std::vector<std::string> &argv, Film *film,
+                           const std::function<void(const Tile &)> &progress) {
+  PROF_FUNC("farm", "spool", spool, "tiles", tiles.size());
+  if (!mkdir_p(spool.c_str(), 0777)) {
+    std::fprintf(stderr, "Failed to create spool directory \"%s\"\n",
+                 spool.c_str());
+    return false;
+  }
+  for (auto &entry : list_dir(spool)) {
+    if (!entry.compare(0, 5, "tile-"))
+      std::remove((spool + "/" + entry).c_str());
+  }
+  FILE *manifest = std::fopen((spool + "/manifest").c_str(), "w");
+  if (manifest == nullptr) {
+    std::fprintf(stderr, "Failed to write farm manifest in \"%s\"\n",
+                 spool.c_str());
+    return false;
+  }
+  const Camera &camera = scene.camera;
+  char source[PATH_MAX];
+  if (realpath(scene.source.c_str(), source) == nullptr) {
+    std::fprintf(stderr, "Failed to resolve \"%s\"\n", scene.source.c_str());
+    std::fclose(manifest);
+    return false;
+  }
+  std::fprintf(manifest, "scene %s\n", source);
+  std::fprintf(manifest, "seed %lu\n", settings.seed);
+  std::fprintf(manifest, "resolution %u %u\n", settings.resolution.x,
+               settings.resolution.y);
+  std::fprintf(manifest, "spp %lu\n", settings.spp);
+  std::fprintf(manifest, "maximumDepth %lu\n", settings.maximum_depth);
+  std::fprintf(manifest, "maximumDistance %a\n", settings.maximum_distance);
+  std::fprintf(manifest, "epsilonDistance %a\n", settings.epsilon_distance);
+  std::fprintf(manifest, "optimize %d\n", settings.optimize ? 1 : 0);
+  std::fprintf(manifest, "segment %d\n", settings.segment_tracing ? 1 : 0);
+  std::fprintf(manifest, "refine %lu\n", settings.refine_steps);
+  std::fprintf(manifest, "analytic %d\n", settings.analytic ? 1 : 0);
+  std::fprintf(manifest, "lod %a\n", settings.lod);
+  std::fprintf(manifest, "kernels %s\n",
+               kernel::name(kernel::selected()));
+  std::fprintf(manifest, "fastMath %d\n", settings.fast_math ? 1 : 0);
+  std::fprintf(manifest, "fov %a\n", camera.fov);
+  std::fprintf(manifest, "pos %a %a %a\n", camera.pos.x, camera.pos.y,
+               camera.pos.z);
+  std::fprintf(manifest, "center %a %a %a\n", camera.center.x,
+               camera.center.y, camera.center.z);
+  std::fprintf(manifest, "up %a %a %a\n", camera.up.x, camera.up.y,
+               camera.up.z);
+  std::fclose(manifest);
+
+  std::vector<Job> jobs;
+  for (std::size_t i = 0; i < tiles.size(); ++i) {
+    jobs.push_back({tiles[i], 0, false});
+    FILE *job =
+        std::fopen((spool + "/" + job_name(i) + ".job.tmp").c_str(), "w");
+    if (job == nullptr)
+      return false;
+    std::fprintf(job, "%u %u %u %u\n", tiles[i].x0, tiles[i].y0, tiles[i].x1,
+                 tiles[i].y1);
+    std::fclose(job);
+    std::rename((spool + "/" + job_name(i) + ".job.tmp").c_str(),
+                (spool + "/" + job_name(i) + ".job").c_str());
+  }
+
+  const std::string host = host_name();
+  std::set<pid_t> workers;
+  for (std::size_t i = 0; i < std::max<std::size_t>(1, settings.farm_workers);
+       ++i) {
+    pid_t pid = spawn(argv, spool);
+    if (pid > 0)
+      workers.insert(pid);
+  }
+
+  bool failed = false;
+  std::size_t remaining = jobs.size();
+  while (remaining != 0 && !failed) {
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      if (jobs[i].done)
+        continue;
+      std::string part = spool + "/" + job_name(i) + ".part";
+      if (!file_exists(part))
+        continue;
+      if (!read_tile(part, jobs[i].tile, film)) {
+        std::fprintf(stderr, "Corrupt partial result \"%s\"\n", part.c_str());
+        std::remove(part.c_str());
+        continue;
+      }
+      std::remove(part.c_str());
+      jobs[i].done = true;
+      remaining--;
+      progress(jobs[i].tile);
+    }
+
+    // Requeue the claims of workers that died and of remote workers whose
+    // heartbeat has been silent for longer than the timeout.
+    std::set<std::string> dead;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      workers.erase(pid);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        dead.insert("." + host + "." + std::to_string(pid) + ".claim");
+    }
+    std::time_t now = std::time(nullptr);
+    for (auto &entry : list_dir(spool)) {
+      if (!ends_with(entry, ".claim"))
+        continue;
+      std::string path = spool + "/" + entry;
+      std::size_t id = std::strtoul(entry.c_str() + 5, nullptr, 10);
+      bool requeue = false;
+      for (auto &suffix : dead)
+        requeue |= ends_with(entry, suffix);
+      struct stat sb;
+      if (!requeue && settings.farm_timeout != 0 &&
+          stat(path.c_str(), &sb) == 0 &&
+          now - sb.st_mtime > static_cast<std::time_t>(settings.farm_timeout))
+        requeue = true;
+      if (!requeue || id >= jobs.size() || jobs[id].done)
+        continue;
+      if (++jobs[id].attempts > settings.farm_retries) {
+        std::fprintf(stderr, "Tile %lu failed %lu times, giving up\n", id,
+                     jobs[id].attempts);
+        failed = true;
+        break;
+      }
+      std::rename(path.c_str(),
+                  (spool + "/" + job_name(id) + ".job").c_str());
+    }
+    if (failed)
+      break;
+    while (remaining != 0 && workers.size() < settings.farm_workers &&
+           dead.size() != 0) {
+      dead.erase(dead.begin());
+      pid_t pid = spawn(argv, spool);
+      if (pid > 0)
+        workers.insert(pid);
+    }
+    if (remaining != 0 && workers.size() == 0) {
+      // Every local worker finished, but requeued tiles or a late remote
+      // result may still be pending.
+      bool queued = false;
+      for (auto &entry : list_dir(spool))
+        queued |= ends_with(entry, ".job");
+      if (queued) {
+        pid_t pid = spawn(argv, spool);
+        if (pid > 0)
+          workers.insert(pid);
+      } else if (settings.farm_timeout == 0) {
+        bool claimed = false, parts = false;
+        for (auto &entry : list_dir(spool)) {
+          claimed |= ends_with(entry, ".claim");
+          parts |= ends_with(entry, ".part");
+        }
+        if (!claimed && !parts) {
+          std::fprintf(stderr, "All workers exited with %lu tiles missing\n",
+                       remaining);
+          failed = true;
+        }
+      }
+    }
+    if (remaining != 0 && !failed)
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  if (failed) {
+    for (auto &pid : workers)
+      kill(pid, SIGTERM);
+  }
+  for (auto &pid : workers)
+    waitpid(pid, nullptr, 0);
+  for (auto &entry : list_dir(spool)) {
+    if (!entry.compare(0, 5, "tile-"))
+      std::remove((spool + "/" + entry).c_str());
+  }
+  std::remove((spool + "/manifest").c_str());
+  rmdir(spool.c_str());
+  return !failed;
+}
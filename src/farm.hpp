@@ -0,0 +1,47 @@
+#ifndef TRM_FARM_HPP_
+#define TRM_FARM_HPP_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "film.hpp"
+#include "scene.hpp"
+#include "settings.hpp"
+#include "type.hpp"
+
+namespace trm {
+namespace farm {
+  // Rectangle of pixels [x0, x1) x [y0, y1) rendered as one unit of work.
+  struct Tile {
+    unsigned x0, y0, x1, y1;
+    inline std::size_t size() const {
+      return static_cast<std::size_t>(x1 - x0) * (y1 - y0);
+    }
+  };
+  // Accumulates samples of every pixel in the tile into a film the size of
+  // the tile.
+  typedef std::function<void(const Tile &, Film *)> TileRenderer;
+
+  std::vector<Tile> split(const uvec2 &res, std::size_t count);
+
+  // Writes the job manifest and one job file per tile into the spool
+  // directory, spawns `workers` copies of `argv` with `--worker <spool>`
+  // appended, and merges their partial results into `film`. Failed workers are replaced and their tiles requeued up to
+  // `settings.farm_retries` times per tile.
+  bool coordinate(const std::string &spool, const std::vector<Tile> &tiles,
+                  const RenderSettings &settings, const Scene &scene,
+                  const std::vector<std::string> &argv, Film *film,
+                  const std::function<void(const Tile &)> &progress);
+  // Claims jobs from the spool directory until none are left.
+  bool work(const std::string &spool, const TileRenderer &render);
+
+  // Overrides every setting that affects the rendered values with the ones
+  // the coordinator recorded, so remote workers match bit for bit, and sets
+  // the scene source to the file the coordinator rendered.
+  bool read_manifest(const std::string &spool, RenderSettings *settings,
+                     Scene *scene);
+} // namespace farm
+} // namespace trm
+
+#endif // TRM_FARM_HPP_
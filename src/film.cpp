@@ -0,0 +1,128 @@
+#include "film.hpp"
+
+#include "prof.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#define CHECKPOINT_MAGIC 0x434d5254u // "TRMC"
+#define CHECKPOINT_VERSION 2u
+
+trm::Film::Film(const uvec2 &res) {
+  allocate(res);
+  clear(0, size());
+}
+
+void trm::Film::allocate(const uvec2 &res) {
+  this->res = res;
+  rgb.reset(new float[3 * size()]);
+  samples.reset(new uint32_t[size()]);
+}
+
+void trm::Film::clear(std::size_t begin, std::size_t end) {
+  std::fill(rgb.get() + 3 * begin, rgb.get() + 3 * end, 0.0f);
+  std::fill(samples.get() + begin, samples.get() + end, 0);
+}
+
+void trm::Film::add(const Film &tile, unsigned x0, unsigned y0) {
+  for (unsigned y = 0; y < tile.res.y; ++y) {
+    std::size_t src = std::size_t(y) * tile.res.x,
+                dst = std::size_t(y0 + y) * res.x + x0;
+    for (unsigned x = 0; x < tile.res.x; ++x) {
+      rgb[3 * (dst + x) + 0] += tile.rgb[3 * (src + x) + 0];
+      rgb[3 * (dst + x) + 1] += tile.rgb[3 * (src + x) + 1];
+      rgb[3 * (dst + x) + 2] += tile.rgb[3 * (src + x) + 2];
+      samples[dst + x] += tile.samples[src + x];
+    }
+  }
+}
+
+void trm::Film::resolve(float *out) const {
+  PROF_FUNC("film");
+  const float *sum = rgb.get();
+  const uint32_t *count = samples.get();
+  const std::ptrdiff_t n = size();
+#pragma omp parallel for simd schedule(static)
+  for (std::ptrdiff_t i = 0; i < n; ++i) {
+    float inv = count[i] != 0 ? 1.0f / count[i] : 0.0f;
+    out[3 * i + 0] = sum[3 * i + 0] * inv;
+    out[3 * i + 1] = sum[3 * i + 1] * inv;
+    out[3 * i + 2] = sum[3 * i + 2] * inv;
+  }
+}
+
+void trm::tonemap(const Film &film, uint8_t *out) {
+  PROF_FUNC("film");
+  const float *sum = film.rgb.get();
+  const uint32_t *count = film.samples.get();
+  const std::ptrdiff_t n = film.size();
+#pragma omp parallel for simd schedule(static)
+  for (std::ptrdiff_t i = 0; i < n; ++i) {
+    float scale = count[i] != 0 ? 255.0f / count[i] : 0.0f;
+    for (int c = 0; c < 3; ++c) {
+      float v = sum[3 * i + c] * scale;
+      v = v > 0.0f ? v : 0.0f;
+      v = v < 255.0f ? v : 255.0f;
+      out[3 * i + c] = uint8_t(v);
+    }
+  }
+}
+
+bool trm::write_checkpoint(const std::string &path, const Film &film,
+                           const CheckpointKey &key) {
+  PROF_FUNC("film", "path", path);
+  std::string tmp = path + ".tmp";
+  FILE *out = std::fopen(tmp.c_str(), "wb");
+  if (out == nullptr) {
+    std::fprintf(stderr, "Failed to open \"%s\"\n", tmp.c_str());
+    return false;
+  }
+  uint32_t header[5] = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, key.res.x,
+                        key.res.y, static_cast<uint32_t>(key.source.size())};
+  uint64_t counts[2] = {key.seed, key.spp};
+  bool ok = std::fwrite(header, sizeof(header), 1, out) == 1 &&
+            std::fwrite(counts, sizeof(counts), 1, out) == 1 &&
+            std::fwrite(key.source.data(), 1, key.source.size(), out) ==
+                key.source.size() &&
+            std::fwrite(film.rgb.get(), sizeof(float) * 3, film.size(),
+                        out) == film.size() &&
+            std::fwrite(film.samples.get(), sizeof(uint32_t), film.size(),
+                        out) == film.size();
+  ok = (std::fclose(out) == 0) && ok;
+  // Renamed into place, so an interrupted write never replaces a good
+  // checkpoint.
+  ok = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+  if (!ok)
+    std::fprintf(stderr, "Failed to write checkpoint \"%s\"\n", path.c_str());
+  return ok;
+}
+
+bool trm::read_checkpoint(const std::string &path, CheckpointKey *key,
+                          Film *film) {
+  PROF_FUNC("film", "path", path);
+  FILE *in = std::fopen(path.c_str(), "rb");
+  if (in == nullptr)
+    return false;
+  uint32_t header[5];
+  uint64_t counts[2];
+  bool ok = std::fread(header, sizeof(header), 1, in) == 1 &&
+            header[0] == CHECKPOINT_MAGIC &&
+            header[1] == CHECKPOINT_VERSION &&
+            std::fread(counts, sizeof(counts), 1, in) == 1;
+  if (ok) {
+    key->res = uvec2(header[2], header[3]);
+    key->seed = counts[0];
+    key->spp = counts[1];
+    key->source.resize(header[4]);
+    ok = std::fread(&key->source[0], 1, header[4], in) == header[4];
+  }
+  if (ok && film != nullptr) {
+    ok = key->res == film->res &&
+         std::fread(film->rgb.get(), sizeof(float) * 3, film->size(), in) ==
+             film->size() &&
+         std::fread(film->samples.get(), sizeof(uint32_t), film->size(),
+                    in) == film->size();
+  }
+  std::fclose(in);
+  return ok;
+}
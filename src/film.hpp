@@ -0,0 +1,63 @@
+#ifndef TRM_FILM_HPP_
+#define TRM_FILM_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "type.hpp"
+
+namespace trm {
+// Float RGB sums and sample counts per pixel. Sums are kept unnormalized so
+// partial renders of the same pixels merge exactly by adding them together.
+struct Film {
+  uvec2 res = uvec2(0);
+  std::unique_ptr<float[]> rgb;
+  std::unique_ptr<uint32_t[]> samples;
+
+  Film() {}
+  // Zero initialized film.
+  explicit Film(const uvec2 &res);
+  // Allocates without touching the pixels, so the threads that clear them
+  // decide on which NUMA node each page is placed.
+  void allocate(const uvec2 &res);
+  void clear(std::size_t begin, std::size_t end);
+  inline std::size_t size() const { return std::size_t(res.x) * res.y; }
+  inline void add(std::size_t i, const Vec3 &sum, uint32_t count) {
+    rgb[3 * i + 0] += sum.r;
+    rgb[3 * i + 1] += sum.g;
+    rgb[3 * i + 2] += sum.b;
+    samples[i] += count;
+  }
+  // Adds a film covering the pixels from (x0, y0) to (x0, y0) + tile.res.
+  void add(const Film &tile, unsigned x0, unsigned y0);
+  // Mean color of every pixel as 3 floats per pixel.
+  void resolve(float *out) const;
+};
+
+// Render a checkpoint was taken of, which is the only one it may resume.
+struct CheckpointKey {
+  uvec2 res;
+  uint64_t seed, spp;
+  std::string source;
+  bool operator==(const CheckpointKey &o) const {
+    return res == o.res && seed == o.seed && spp == o.spp &&
+           source == o.source;
+  }
+  bool operator!=(const CheckpointKey &o) const { return !(*this == o); }
+};
+
+// Checkpoints hold the key of their render, the sums and the sample counts.
+// Samples are seeded by pixel and sample index, so a pixel's sample count is
+// also the position its random stream resumes from. `film` may be null to
+// only read the key, and is only read into when its resolution is the key's.
+bool write_checkpoint(const std::string &path, const Film &film,
+                      const CheckpointKey &key);
+bool read_checkpoint(const std::string &path, CheckpointKey *key,
+                     Film *film = nullptr);
+
+// Clamps the mean color of every pixel to [0, 1] and quantizes it to 8 bits.
+void tonemap(const Film &film, uint8_t *out);
+} // namespace trm
+
+#endif // TRM_FILM_HPP_
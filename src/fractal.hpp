@@ -0,0 +1,195 @@
+#ifndef TRM_FRACTAL_HPP_
+#define TRM_FRACTAL_HPP_
+
+#include "type.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace trm {
+namespace fractal {
+// Point being iterated and the point it started from, the factor lengths
+// around it have grown by, the running value of fractals that carve their
+// shape a little more every iteration, and the smallest squared length the
+// point has had, for orbit traps.
+struct State {
+  explicit State(const Vec3 &p)
+      : z(p), c(p), dr(1.0f), d(-std::numeric_limits<Float>::infinity()),
+        trap(std::numeric_limits<Float>::infinity()) {}
+  Vec3 z, c;
+  Float dr, d, trap;
+};
+
+// The operations below make up the iterations. Folds are written without
+// branches, as selects, min and max, which compile to blends.
+
+// Mirrors every axis onto its positive half.
+struct AbsFold {
+  inline void operator()(State *s) const { s->z = abs(s->z); }
+};
+// Sorts the coordinates in decreasing order, mirroring through the planes
+// x = y, x = z and y = z. After `AbsFold`, this folds the 48 images of the
+// octahedral group onto one.
+struct SortFold {
+  inline void operator()(State *s) const {
+    Float hi = max(s->z.x, s->z.y), lo = min(s->z.x, s->z.y);
+    Float mid = min(hi, s->z.z);
+    s->z = Vec3(max(hi, s->z.z), max(lo, mid), min(lo, mid));
+  }
+};
+// Mirrors through the planes x + y = 0, x + z = 0 and y + z = 0 onto the
+// side of the positive octant, folding the tetrahedral group. Coordinates are
+// only swapped and negated, so the result is exact.
+struct TetraFold {
+  inline void operator()(State *s) const {
+    Float x = s->z.x, y = s->z.y, z = s->z.z;
+    fold(x, y);
+    fold(x, z);
+    fold(y, z);
+    s->z = Vec3(x, y, z);
+  }
+  static inline void fold(Float &a, Float &b) {
+    bool flip = a + b < 0.0f;
+    Float fa = flip ? -b : a;
+    b = flip ? -a : b;
+    a = fa;
+  }
+};
+// Folds space into copies of the cell [-1, 1)^3 repeating every 2 units.
+struct Tile {
+  inline void operator()(State *s) const {
+    s->z -= 2.0f * floor(0.5f * s->z + 0.5f);
+  }
+};
+// Mandelbox box fold: reflects every coordinate beyond `limit` back inside.
+struct BoxFold {
+  explicit BoxFold(Float limit) : limit(limit) {}
+  inline void operator()(State *s) const {
+    s->z = clamp(s->z, -limit, limit) * 2.0f - s->z;
+  }
+  Float limit;
+};
+// Mandelbox sphere fold: inverts points inside the sphere of radius
+// sqrt(`fixed2`), and scales those inside sqrt(`min2`) up linearly.
+struct SphereFold {
+  SphereFold(Float min2, Float fixed2) : fixed2(fixed2), most(fixed2 / min2) {}
+  inline void operator()(State *s) const {
+    Float k = clamp(fixed2 / dot(s->z, s->z), 1.0f, most);
+    s->z *= k;
+    s->dr *= k;
+  }
+  Float fixed2, most;
+};
+// Rotation by the 3x3 matrix with the given columns.
+struct Rotate {
+  Rotate(const Vec3 &x, const Vec3 &y, const Vec3 &z) : x(x), y(y), z(z) {}
+  inline void operator()(State *s) const {
+    s->z = x * s->z.x + y * s->z.y + z * s->z.z;
+  }
+  Vec3 x, y, z;
+};
+// Scales about the origin.
+struct Scale {
+  explicit Scale(Float k) : k(k) {}
+  inline void operator()(State *s) const {
+    s->z *= k;
+    s->dr *= abs(k);
+  }
+  Float k;
+};
+// Scales about `offset`, which stays put.
+struct ScaleOffset {
+  ScaleOffset(Float k, const Vec3 &offset) : k(k), shift(offset * (k - 1.0f)) {}
+  inline void operator()(State *s) const {
+    s->z = s->z * k - shift;
+    s->dr *= abs(k);
+  }
+  Float k;
+  Vec3 shift;
+};
+// Scales about the origin and adds the starting point, as escape time
+// fractals do.
+struct ScaleAdd {
+  explicit ScaleAdd(Float k) : k(k) {}
+  inline void operator()(State *s) const {
+    s->z = s->z * k + s->c;
+    s->dr = s->dr * abs(k) + 1.0f;
+  }
+  Float k;
+};
+// Raises the point to the power `n` in spherical coordinates and adds the
+// starting point, the Mandelbulb's version of z^n + c. The angles go through
+// the functions of `Math`, see approx.hpp.
+template <typename Math> struct Power {
+  explicit Power(Float n) : n(n) {}
+  inline void operator()(State *s) const {
+    Float r = length(s->z);
+    Float theta = std::acos(r > 0.0f ? clamp(s->z.z / r, -1.0f, 1.0f) : 1.0f);
+    Float phi = Math::atan2(s->z.y, s->z.x);
+    Float rn1 = std::pow(r, n - 1.0f);
+    s->dr = n * rn1 * s->dr + 1.0f;
+    Float st, ct, sp, cp;
+    Math::sincos(theta * n, &st, &ct);
+    Math::sincos(phi * n, &sp, &cp);
+    s->z = rn1 * r * Vec3(st * cp, st * sp, ct) + s->c;
+  }
+  Float n;
+};
+// Carves the three square tunnels of the Menger sponge through the cell the
+// point was tiled into and scaled up by 3.
+struct CrossCarve {
+  inline void operator()(State *s) const {
+    Vec3 r = abs(1.0f - abs(s->z));
+    Float c = min(max(r.x, r.y), min(max(r.y, r.z), max(r.z, r.x))) - 1.0f;
+    s->d = max(s->d, c / s->dr);
+  }
+};
+
+// One iteration: the operations in order, resolved at compile time so they
+// inline into a single loop body.
+template <typename... Ops> struct Chain;
+template <> struct Chain<> {
+  inline void operator()(State *) const {}
+};
+template <typename Op, typename... Rest> struct Chain<Op, Rest...> {
+  Chain(const Op &op, const Rest &... rest) : op(op), rest(rest...) {}
+  inline void operator()(State *s) const {
+    op(s);
+    rest(s);
+  }
+  Op op;
+  Chain<Rest...> rest;
+};
+template <typename... Ops> Chain<Ops...> chain(const Ops &... ops) {
+  return Chain<Ops...>(ops...);
+}
+
+// Applies `step` up to `iterations` times and returns how many times it did.
+// Iterations stop early once the value carved so far reaches `cutoff`, or
+// once `detail`, the size of what the next iteration adds in the frame of the
+// point, shrunk by `dr`, is smaller than `footprint`. With `Escape`, they
+// also stop once the point is farther from the origin than
+// sqrt(`bailout2`), and with `Trap`, the orbit trap is kept.
+template <bool Trap, bool Escape, typename Step>
+inline std::size_t
+iterate(const Step &step, State *s, std::size_t iterations, Float detail,
+        Float footprint,
+        Float cutoff = std::numeric_limits<Float>::infinity(),
+        Float bailout2 = std::numeric_limits<Float>::infinity()) {
+  std::size_t i = 0;
+  for (; i < iterations; ++i) {
+    if (s->d >= cutoff || detail < footprint * s->dr)
+      break;
+    if (Escape && dot(s->z, s->z) > bailout2)
+      break;
+    step(s);
+    if (Trap)
+      s->trap = min(s->trap, dot(s->z, s->z));
+  }
+  return i;
+}
+} // namespace fractal
+} // namespace trm
+
+#endif // TRM_FRACTAL_HPP_
@@ -6,15 +6,38 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "numa.hpp"
 #include "prof.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void encode_alongside(int threads) {
+  // Encoding threads are started by the main thread, and would otherwise
+  // share the one CPU --affinity pinned that to.
+  trm::numa::unpin();
+#ifdef _OPENMP
+  omp_set_num_threads(threads > 0 ? threads
+                                  : std::max(1, omp_get_num_procs() / 4));
+#endif
+}
+
 bool mkdir_p(const char *dir, const mode_t mode) {
   char tmp[PATH_MAX_STRING_SIZE];
   char *p = NULL;
@@ -67,8 +90,631 @@ bool ends_with(const std::string &str, const std::string &suffix) {
              0;
 }
 
+namespace {
+const uint32_t ADLER_BASE = 65521;
+const std::size_t WINDOW = 32768;
+const std::size_t CHUNK_SIZE = 1 << 18;
+const std::size_t HASH_BITS = 15;
+
+uint32_t crc32(const uint8_t *data, std::size_t len, uint32_t crc = 0) {
+  static uint32_t table[256] = {0};
+  static std::once_flag init;
+  std::call_once(init, []() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[n] = c;
+    }
+  });
+  crc = ~crc;
+  for (std::size_t i = 0; i < len; ++i)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+uint32_t adler32(const uint8_t *data, std::size_t len) {
+  uint32_t a = 1, b = 0;
+  while (len > 0) {
+    std::size_t n = std::min<std::size_t>(len, 5552);
+    len -= n;
+    while (n--) {
+      a += *data++;
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+  }
+  return (b << 16) | a;
+}
+
+// Checksum of the concatenation of two buffers, from their own checksums and
+// the length of the second.
+uint32_t adler32_combine(uint32_t a1, uint32_t a2, std::size_t len2) {
+  uint32_t rem = len2 % ADLER_BASE;
+  uint32_t sum1 = a1 & 0xffff;
+  uint32_t sum2 = (rem * sum1) % ADLER_BASE;
+  sum1 += (a2 & 0xffff) + ADLER_BASE - 1;
+  sum2 += (a1 >> 16) + (a2 >> 16) + ADLER_BASE - rem;
+  if (sum1 >= ADLER_BASE)
+    sum1 -= ADLER_BASE;
+  if (sum1 >= ADLER_BASE)
+    sum1 -= ADLER_BASE;
+  if (sum2 >= (ADLER_BASE << 1))
+    sum2 -= (ADLER_BASE << 1);
+  if (sum2 >= ADLER_BASE)
+    sum2 -= ADLER_BASE;
+  return sum1 | (sum2 << 16);
+}
+
+// LSB first bit packer used by deflate.
+struct BitWriter {
+  std::vector<uint8_t> out;
+  uint64_t bits = 0;
+  unsigned count = 0;
+  inline void put(uint32_t value, unsigned n) {
+    bits |= uint64_t(value) << count;
+    count += n;
+    while (count >= 8) {
+      out.push_back(bits & 0xff);
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+  // Huffman codes are defined most significant bit first.
+  inline void put_code(uint32_t code, unsigned n) {
+    uint32_t rev = 0;
+    for (unsigned i = 0; i < n; ++i)
+      rev |= ((code >> i) & 1) << (n - 1 - i);
+    put(rev, n);
+  }
+  inline void align() {
+    if (count > 0)
+      put(0, 8 - count);
+  }
+};
+
+const uint16_t LENGTH_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                  2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DIST_BASE[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+const uint8_t DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+inline void put_literal(BitWriter *bw, unsigned v) {
+  if (v < 144)
+    bw->put_code(0x30 + v, 8);
+  else if (v < 256)
+    bw->put_code(0x190 + v - 144, 9);
+  else if (v < 280)
+    bw->put_code(v - 256, 7);
+  else
+    bw->put_code(0xc0 + v - 280, 8);
+}
+
+inline void put_match(BitWriter *bw, unsigned len, unsigned dist) {
+  unsigned l = 0;
+  while (l < 28 && LENGTH_BASE[l + 1] <= len)
+    l++;
+  put_literal(bw, 257 + l);
+  bw->put(len - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+  unsigned d = 0;
+  while (d < 29 && DIST_BASE[d + 1] <= dist)
+    d++;
+  bw->put_code(d, 5);
+  bw->put(dist - DIST_BASE[d], DIST_EXTRA[d]);
+}
+
+inline uint32_t hash3(const uint8_t *p) {
+  uint32_t v = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16;
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Compresses data[begin, end) as one fixed Huffman block, allowing matches
+// back into the 32KB before `begin` as if it were a preset dictionary. The
+// chunk ends with a sync flush, so chunks start on byte boundaries and
+// concatenate into one deflate stream. Level 0 stores the data uncompressed,
+// higher levels follow longer hash chains.
+std::vector<uint8_t> deflate_chunk(const uint8_t *data, std::size_t begin,
+                                   std::size_t end, int level) {
+  BitWriter bw;
+  if (level <= 0) {
+    std::size_t pos = begin;
+    do {
+      std::size_t len = std::min<std::size_t>(end - pos, 65535);
+      bw.put(0, 3);
+      bw.align();
+      bw.put(len, 16);
+      bw.put(~len & 0xffff, 16);
+      bw.out.insert(bw.out.end(), data + pos, data + pos + len);
+      pos += len;
+    } while (pos < end);
+    return bw.out;
+  }
+
+  static const unsigned CHAIN[10] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+  const unsigned max_chain = CHAIN[std::min(level, 9)];
+  const unsigned nice = level <= 3 ? 32 : 258;
+  const std::size_t base = begin > WINDOW ? begin - WINDOW : 0;
+  std::vector<int32_t> head(std::size_t(1) << HASH_BITS, -1);
+  std::vector<int32_t> prev(end - base, -1);
+  auto insert = [&](std::size_t pos) {
+    uint32_t h = hash3(data + pos);
+    prev[pos - base] = head[h];
+    head[h] = static_cast<int32_t>(pos - base);
+  };
+  for (std::size_t pos = base; pos + 3 <= begin; ++pos)
+    insert(pos);
+
+  bw.put(1 << 1, 3);
+  std::size_t pos = begin;
+  while (pos < end) {
+    unsigned best_len = 0, best_dist = 0;
+    if (pos + 3 <= end) {
+      const unsigned max_len = std::min<std::size_t>(258, end - pos);
+      int32_t cand = head[hash3(data + pos)];
+      for (unsigned chain = 0; cand >= 0 && chain < max_chain; ++chain) {
+        std::size_t c = base + cand;
+        if (pos - c > WINDOW)
+          break;
+        if (data[c + best_len] == data[pos + best_len]) {
+          unsigned len = 0;
+          while (len < max_len && data[c + len] == data[pos + len])
+            len++;
+          if (len > best_len) {
+            best_len = len;
+            best_dist = pos - c;
+            if (len >= nice || len == max_len)
+              break;
+          }
+        }
+        cand = prev[c - base];
+      }
+    }
+    if (best_len >= 3) {
+      put_match(&bw, best_len, best_dist);
+      for (std::size_t i = 0; i < best_len; ++i, ++pos) {
+        if (pos + 3 <= end)
+          insert(pos);
+      }
+    } else {
+      put_literal(&bw, data[pos]);
+      if (pos + 3 <= end)
+        insert(pos);
+      pos++;
+    }
+  }
+  put_literal(&bw, 256);
+  bw.put(0, 3);
+  bw.align();
+  bw.put(0x0000, 16);
+  bw.put(0xffff, 16);
+  return bw.out;
+}
+
+inline uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b),
+      pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// Filters one scanline with each PNG filter and keeps the one with the
+// smallest sum of absolute residuals.
+void filter_row(const uint8_t *row, const uint8_t *up, std::size_t len,
+                uint8_t *out, int level) {
+  uint8_t best = 0;
+  uint64_t best_sum = UINT64_MAX;
+  std::vector<uint8_t> tmp(len);
+  for (uint8_t f = 0; f < 5; ++f) {
+    if (level <= 0 && f != 0)
+      break;
+    uint64_t sum = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+      uint8_t a = i >= 3 ? row[i - 3] : 0, b = up ? up[i] : 0,
+              c = (i >= 3 && up) ? up[i - 3] : 0, v = row[i];
+      switch (f) {
+      case 1:
+        v -= a;
+        break;
+      case 2:
+        v -= b;
+        break;
+      case 3:
+        v -= (a + b) / 2;
+        break;
+      case 4:
+        v -= paeth(a, b, c);
+        break;
+      }
+      tmp[i] = v;
+      sum += std::abs(int(int8_t(v)));
+    }
+    if (sum < best_sum) {
+      best_sum = sum;
+      best = f;
+      std::copy(tmp.begin(), tmp.end(), out + 1);
+    }
+  }
+  out[0] = best;
+}
+
+void put_chunk(FILE *out, const char *type, const uint8_t *data,
+               std::size_t len) {
+  uint8_t header[8] = {uint8_t(len >> 24), uint8_t(len >> 16),
+                       uint8_t(len >> 8),  uint8_t(len),
+                       uint8_t(type[0]),   uint8_t(type[1]),
+                       uint8_t(type[2]),   uint8_t(type[3])};
+  uint32_t crc = crc32(data, len, crc32(header + 4, 4));
+  uint8_t footer[4] = {uint8_t(crc >> 24), uint8_t(crc >> 16),
+                       uint8_t(crc >> 8), uint8_t(crc)};
+  std::fwrite(header, 1, 8, out);
+  if (len != 0)
+    std::fwrite(data, 1, len, out);
+  std::fwrite(footer, 1, 4, out);
+}
+// PNG encoder that takes rows in batches. Rows of a batch are filtered in
+// parallel, then deflated in groups that each become their own IDAT chunk;
+// the last 32KB of the previous batch seeds the first group's dictionary.
+class PngEncoder {
+public:
+  bool open(const std::string &file_desc, const glm::uvec2 &res, int level) {
+    out_ = std::fopen(file_desc.c_str(), "wb");
+    if (out_ == nullptr) {
+      std::fprintf(stderr, "Failed to open \"%s\"\n", file_desc.c_str());
+      return false;
+    }
+    res_ = res;
+    level_ = level;
+    static const uint8_t signature[8] = {0x89, 'P',  'N',  'G',
+                                         '\r', '\n', 0x1a, '\n'};
+    std::fwrite(signature, 1, 8, out_);
+    uint8_t ihdr[13] = {uint8_t(res.x >> 24), uint8_t(res.x >> 16),
+                        uint8_t(res.x >> 8),  uint8_t(res.x),
+                        uint8_t(res.y >> 24), uint8_t(res.y >> 16),
+                        uint8_t(res.y >> 8),  uint8_t(res.y),
+                        8, 2, 0, 0, 0};
+    put_chunk(out_, "IHDR", ihdr, 13);
+    const uint8_t zlib_header[2] = {0x78, 0x01};
+    put_chunk(out_, "IDAT", zlib_header, 2);
+    return true;
+  }
+
+  // Encodes `count` rows in image order, the first at `first` and each next
+  // one `stride` bytes after it.
+  void write_rows(const uint8_t *first, std::ptrdiff_t stride,
+                  std::size_t count) {
+    PROF_FUNC("renderer", "rows", count);
+    const std::size_t width = 3 * std::size_t(res_.x), line = width + 1;
+    const std::size_t dict = window_.size();
+    std::vector<uint8_t> filtered(dict + line * count);
+    std::copy(window_.begin(), window_.end(), filtered.begin());
+#pragma omp parallel for schedule(static)
+    for (std::size_t y = 0; y < count; ++y) {
+      const uint8_t *row = first + std::ptrdiff_t(y) * stride;
+      const uint8_t *up = y != 0 ? row - stride
+                                 : (prev_.empty() ? nullptr : prev_.data());
+      filter_row(row, up, width, filtered.data() + dict + y * line, level_);
+    }
+
+    const std::size_t size = filtered.size() - dict;
+    const std::size_t groups = std::max<std::size_t>(1, size / CHUNK_SIZE);
+    std::vector<std::vector<uint8_t>> chunks(groups);
+    std::vector<uint32_t> adlers(groups);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t i = 0; i < groups; ++i) {
+      std::size_t begin = dict + size * i / groups,
+                  end = dict + size * (i + 1) / groups;
+      chunks[i] = deflate_chunk(filtered.data(), begin, end, level_);
+      adlers[i] = adler32(filtered.data() + begin, end - begin);
+    }
+    for (std::size_t i = 0; i < groups; ++i) {
+      adler_ = adler32_combine(adler_, adlers[i],
+                               size * (i + 1) / groups - size * i / groups);
+      put_chunk(out_, "IDAT", chunks[i].data(), chunks[i].size());
+    }
+
+    std::size_t keep = std::min(WINDOW, filtered.size());
+    window_.assign(filtered.end() - keep, filtered.end());
+    const uint8_t *last = first + std::ptrdiff_t(count - 1) * stride;
+    prev_.assign(last, last + width);
+  }
+
+  bool close() {
+    // An empty final block ends the deflate stream.
+    BitWriter bw;
+    bw.put(1 | 1 << 1, 3);
+    put_literal(&bw, 256);
+    bw.align();
+    for (int shift = 24; shift >= 0; shift -= 8)
+      bw.out.push_back(uint8_t(adler_ >> shift));
+    put_chunk(out_, "IDAT", bw.out.data(), bw.out.size());
+    put_chunk(out_, "IEND", nullptr, 0);
+    return std::fclose(out_) == 0;
+  }
+
+private:
+  FILE *out_ = nullptr;
+  glm::uvec2 res_;
+  int level_ = 6;
+  uint32_t adler_ = 1;
+  std::vector<uint8_t> window_, prev_;
+};
+
+std::vector<uint8_t> exr_header(const glm::uvec2 &res) {
+  std::vector<uint8_t> header;
+  auto put = [&header](const void *data, std::size_t len) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    header.insert(header.end(), bytes, bytes + len);
+  };
+  auto put_i32 = [&put](int32_t v) { put(&v, 4); };
+  auto put_f32 = [&put](float v) { put(&v, 4); };
+  auto attr = [&put, &put_i32](const char *name, const char *type,
+                               int32_t size) {
+    put(name, std::strlen(name) + 1);
+    put(type, std::strlen(type) + 1);
+    put_i32(size);
+  };
+  const int32_t magic = 20000630, version = 2;
+  put_i32(magic);
+  put_i32(version);
+  // Channels are stored in alphabetical order, as 32 bit floats.
+  attr("channels", "chlist", 3 * 18 + 1);
+  for (const char *channel : {"B", "G", "R"}) {
+    put(channel, 2);
+    put_i32(2);
+    put_i32(0);
+    put_i32(1);
+    put_i32(1);
+  }
+  put("", 1);
+  attr("compression", "compression", 1);
+  put("", 1);
+  const int32_t window[4] = {0, 0, int32_t(res.x) - 1, int32_t(res.y) - 1};
+  attr("dataWindow", "box2i", 16);
+  put(window, 16);
+  attr("displayWindow", "box2i", 16);
+  put(window, 16);
+  attr("lineOrder", "lineOrder", 1);
+  put("", 1);
+  attr("pixelAspectRatio", "float", 4);
+  put_f32(1.0f);
+  attr("screenWindowCenter", "v2f", 8);
+  put_f32(0.0f);
+  put_f32(0.0f);
+  attr("screenWindowWidth", "float", 4);
+  put_f32(1.0f);
+  put("", 1);
+  return header;
+}
+
+// Scanline EXR block of one row: its index, byte count and the B, G and R
+// planes. EXR rows run top down, so image row y is rendered row h - 1 - y.
+inline void exr_line(const float *row, uint32_t width, int32_t y,
+                     uint8_t *out) {
+  int32_t block[2] = {y, int32_t(3 * 4 * width)};
+  std::memcpy(out, block, 8);
+  float *planes = reinterpret_cast<float *>(out + 8);
+  for (uint32_t x = 0; x < width; ++x) {
+    planes[x] = row[3 * x + 2];
+    planes[width + x] = row[3 * x + 1];
+    planes[2 * width + x] = row[3 * x + 0];
+  }
+}
+
+class PngStreamWriter : public StreamWriter {
+public:
+  explicit PngStreamWriter(int level) : level_(level) {}
+  bool open(const std::string &file_desc, const glm::uvec2 &res) {
+    return png_.open(file_desc, res, level_);
+  }
+  bool write(const trm::Film &band, unsigned) override {
+    std::vector<uint8_t> raw(3 * band.size());
+    trm::tonemap(band, raw.data());
+    std::ptrdiff_t stride = 3 * std::ptrdiff_t(band.res.x);
+    png_.write_rows(raw.data() + (band.res.y - 1) * stride, -stride,
+                    band.res.y);
+    return true;
+  }
+  bool close() override { return png_.close(); }
+
+private:
+  int level_;
+  PngEncoder png_;
+};
+
+// PFM and EXR have fixed size rows, so bands are resolved straight into a
+// shared mapping of the output file and dropped from memory once written.
+class MappedStreamWriter : public StreamWriter {
+public:
+  ~MappedStreamWriter() {
+    if (data_ != nullptr)
+      close();
+  }
+  bool open(const std::string &file_desc, const glm::uvec2 &res) {
+    res_ = res;
+    exr_ = ends_with(file_desc, ".exr");
+    std::vector<uint8_t> header;
+    if (exr_) {
+      header = exr_header(res);
+      line_ = 8 + 3 * 4 * std::size_t(res.x);
+      header_ = header.size() + 8 * std::size_t(res.y);
+    } else {
+      char pfm[64];
+      int len = std::snprintf(pfm, sizeof(pfm), "PF\n%u %u\n-1.0\n", res.x,
+                              res.y);
+      header.assign(pfm, pfm + len);
+      line_ = 3 * 4 * std::size_t(res.x);
+      header_ = header.size();
+    }
+    size_ = header_ + line_ * res.y;
+    int fd = ::open(file_desc.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size_) != 0) {
+      std::fprintf(stderr, "Failed to open \"%s\"\n", file_desc.c_str());
+      if (fd >= 0)
+        ::close(fd);
+      return false;
+    }
+    void *map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      std::fprintf(stderr, "Failed to map \"%s\"\n", file_desc.c_str());
+      return false;
+    }
+    data_ = static_cast<uint8_t *>(map);
+    std::memcpy(data_, header.data(), header.size());
+    if (exr_) {
+      uint64_t *offsets = reinterpret_cast<uint64_t *>(data_ + header.size());
+      for (uint32_t y = 0; y < res.y; ++y)
+        offsets[y] = header_ + line_ * y;
+    }
+    return true;
+  }
+  bool write(const trm::Film &band, unsigned y0) override {
+    std::vector<float> rgb(3 * band.size());
+    band.resolve(rgb.data());
+    std::size_t begin, end;
+    if (exr_) {
+      for (unsigned y = 0; y < band.res.y; ++y) {
+        int32_t line = res_.y - 1 - (y0 + y);
+        exr_line(rgb.data() + 3 * std::size_t(y) * band.res.x, res_.x, line,
+                 data_ + header_ + line_ * line);
+      }
+      begin = header_ + line_ * (res_.y - y0 - band.res.y);
+      end = header_ + line_ * (res_.y - y0);
+    } else {
+      begin = header_ + line_ * y0;
+      end = begin + line_ * band.res.y;
+      std::memcpy(data_ + begin, rgb.data(), end - begin);
+    }
+    // Only whole pages are released, the pages at either end may be shared
+    // with bands that are not written yet.
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    if (end > begin) {
+      msync(data_ + begin, end - begin, MS_ASYNC);
+      madvise(data_ + begin, end - begin, MADV_DONTNEED);
+    }
+    return true;
+  }
+  bool close() override {
+    bool ok = msync(data_, size_, MS_SYNC) == 0;
+    ok = munmap(data_, size_) == 0 && ok;
+    data_ = nullptr;
+    return ok;
+  }
+
+private:
+  glm::uvec2 res_;
+  bool exr_ = false;
+  std::size_t header_ = 0, line_ = 0, size_ = 0;
+  uint8_t *data_ = nullptr;
+};
+} // namespace
+
+bool write_png(const std::string &file_desc, const glm::uvec2 &res,
+               const uint8_t *raw, int level) {
+  PROF_FUNC("renderer", "level", level);
+  PngEncoder png;
+  if (!png.open(file_desc, res, level))
+    return false;
+  // Rows are flipped so the first rendered row is at the bottom.
+  std::ptrdiff_t stride = 3 * std::ptrdiff_t(res.x);
+  png.write_rows(raw + (res.y - 1) * stride, -stride, res.y);
+  return png.close();
+}
+
+std::unique_ptr<StreamWriter>
+StreamWriter::open(const std::string &file_desc, const glm::uvec2 &res,
+                   int png_level) {
+  std::size_t dir_sep_pos = 0;
+  if ((dir_sep_pos = file_desc.rfind('/')) != std::string::npos) {
+    mkdir_p(file_desc.substr(0, dir_sep_pos).c_str(), 0777);
+  }
+  if (ends_with(file_desc, "png")) {
+    PngStreamWriter *png = new PngStreamWriter(png_level);
+    std::unique_ptr<StreamWriter> stream(png);
+    if (png->open(file_desc, res))
+      return stream;
+  } else if (is_float_format(file_desc)) {
+    MappedStreamWriter *mapped = new MappedStreamWriter();
+    std::unique_ptr<StreamWriter> stream(mapped);
+    if (mapped->open(file_desc, res))
+      return stream;
+  } else {
+    std::fprintf(stderr, "Streaming supports png, pfm and exr, not \"%s\"\n",
+                 file_desc.c_str());
+  }
+  return nullptr;
+}
+
+bool is_float_format(const std::string &file_desc) {
+  return ends_with(file_desc, ".pfm") || ends_with(file_desc, ".exr");
+}
+
+bool write_pfm(const std::string &file_desc, const glm::uvec2 &res,
+               const float *rgb) {
+  PROF_FUNC("renderer", "file_desc", file_desc);
+  FILE *out = std::fopen(file_desc.c_str(), "wb");
+  if (out == nullptr) {
+    std::fprintf(stderr, "Failed to open \"%s\"\n", file_desc.c_str());
+    return false;
+  }
+  // PFM stores the bottom row first, which is the first rendered row, and a
+  // negative scale marks little endian data.
+  std::fprintf(out, "PF\n%u %u\n-1.0\n", res.x, res.y);
+  std::fwrite(rgb, sizeof(float) * 3, std::size_t(res.x) * res.y, out);
+  return std::fclose(out) == 0;
+}
+
+bool write_exr(const std::string &file_desc, const glm::uvec2 &res,
+               const float *rgb) {
+  PROF_FUNC("renderer", "file_desc", file_desc);
+  FILE *out = std::fopen(file_desc.c_str(), "wb");
+  if (out == nullptr) {
+    std::fprintf(stderr, "Failed to open \"%s\"\n", file_desc.c_str());
+    return false;
+  }
+  std::vector<uint8_t> header = exr_header(res);
+  std::fwrite(header.data(), 1, header.size(), out);
+  const std::size_t line_size = 8 + 3 * 4 * std::size_t(res.x);
+  uint64_t offset = header.size() + 8 * uint64_t(res.y);
+  for (uint32_t y = 0; y < res.y; ++y) {
+    std::fwrite(&offset, 8, 1, out);
+    offset += line_size;
+  }
+  std::vector<uint8_t> line(line_size);
+  for (uint32_t y = 0; y < res.y; ++y) {
+    exr_line(rgb + 3 * std::size_t(res.y - 1 - y) * res.x, res.x, y,
+             line.data());
+    std::fwrite(line.data(), 1, line.size(), out);
+  }
+  return std::fclose(out) == 0;
+}
+
 void write_file(const std::string &file_desc, const glm::uvec2 &res,
-                const uint8_t *raw) {
+                const float *rgb) {
+  std::size_t dir_sep_pos = 0;
+  if ((dir_sep_pos = file_desc.rfind('/')) != std::string::npos) {
+    mkdir_p(file_desc.substr(0, dir_sep_pos).c_str(), 0777);
+  }
+  if (ends_with(file_desc, ".pfm")) {
+    write_pfm(file_desc, res, rgb);
+  } else if (ends_with(file_desc, ".exr")) {
+    write_exr(file_desc, res, rgb);
+  }
+}
+
+void write_file(const std::string &file_desc, const glm::uvec2 &res,
+                const uint8_t *raw, int png_level) {
   PROF_FUNC("renderer", "file_desc", file_desc, "width", res.x, "height",
             res.y);
   std::size_t dir_sep_pos = 0;
@@ -77,8 +723,7 @@ void write_file(const std::string &file_desc, const glm::uvec2 &res,
   }
   stbi_flip_vertically_on_write(true);
   if (ends_with(file_desc, "png")) {
-    stbi_write_png(file_desc.c_str(), res.x, res.y, 3, raw,
-                   res.x * 3 * sizeof(uint8_t));
+    write_png(file_desc, res, raw, png_level);
   } else if (ends_with(file_desc, ".bmp")) {
     stbi_write_bmp(file_desc.c_str(), res.x, res.y, 3, raw);
   } else if (ends_with(file_desc, ".tga")) {
@@ -90,3 +735,58 @@ void write_file(const std::string &file_desc, const glm::uvec2 &res,
 bool file_exists(const std::string &file) {
   return access(file.c_str(), F_OK) != -1;
 }
+
+ImageWriter::ImageWriter(std::size_t depth, int threads)
+    : depth_(depth), threads_(threads) {}
+ImageWriter::~ImageWriter() {
+  flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+void ImageWriter::push(const std::string &file_desc, trm::Film &&film,
+                       int png_level) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!thread_.joinable())
+    thread_ = std::thread(&ImageWriter::run, this);
+  cond_.wait(lock, [this]() { return jobs_.size() < depth_; });
+  jobs_.push({file_desc, std::move(film), png_level});
+  cond_.notify_all();
+}
+
+void ImageWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this]() { return jobs_.empty() && !busy_; });
+}
+
+void ImageWriter::run() {
+  encode_alongside(threads_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+    if (jobs_.empty())
+      return;
+    Job job = std::move(jobs_.front());
+    jobs_.pop();
+    busy_ = true;
+    cond_.notify_all();
+    lock.unlock();
+    if (is_float_format(job.file_desc)) {
+      std::vector<float> rgb(3 * job.film.size());
+      job.film.resolve(rgb.data());
+      write_file(job.file_desc, job.film.res, rgb.data());
+    } else {
+      std::vector<uint8_t> raw(3 * job.film.size());
+      trm::tonemap(job.film, raw.data());
+      write_file(job.file_desc, job.film.res, raw.data(), job.png_level);
+    }
+    lock.lock();
+    busy_ = false;
+    cond_.notify_all();
+  }
+}
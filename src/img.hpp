@@ -1,6 +1,86 @@
+#ifndef TRM_IMG_HPP_
+#define TRM_IMG_HPP_
+
+#include <condition_variable>
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <sys/types.h>
+#include <thread>
+
+#include "film.hpp"
 
+// `png_level` trades PNG size for speed, from 0 (stored) to 9.
+void write_file(const std::string &file_desc, const glm::uvec2 &res,
+                const uint8_t *raw, int png_level = 6);
 void write_file(const std::string &file_desc, const glm::uvec2 &res,
-                const uint8_t *raw);
+                const float *rgb);
+// Deflates groups of rows in parallel as independent fixed Huffman blocks
+// that may reference the previous group as a preset dictionary, and stitches
+// them into one zlib stream.
+bool write_png(const std::string &file_desc, const glm::uvec2 &res,
+               const uint8_t *raw, int level);
+// Writes 3 floats per pixel as PFM, or as an uncompressed scanline EXR.
+bool write_pfm(const std::string &file_desc, const glm::uvec2 &res,
+               const float *rgb);
+bool write_exr(const std::string &file_desc, const glm::uvec2 &res,
+               const float *rgb);
+// True for formats that store float pixels instead of 8 bit ones.
+bool is_float_format(const std::string &file_desc);
+// Readies the calling thread to encode while a render runs: unpins it, and
+// caps the OpenMP teams it starts at `threads`, or a quarter of the CPUs
+// when 0, so that encoding takes few cores from the render.
+void encode_alongside(int threads = 0);
+bool mkdir_p(const char *dir, const mode_t mode);
 bool file_exists(const std::string &file);
+
+// Encoder for renders that are written a band of rows at a time, so only the
+// band in flight has to be kept in memory.
+class StreamWriter {
+public:
+  virtual ~StreamWriter() {}
+  // Opens a PNG, PFM or EXR stream, or returns nullptr for other formats.
+  static std::unique_ptr<StreamWriter> open(const std::string &file_desc,
+                                            const glm::uvec2 &res,
+                                            int png_level = 6);
+  // Writes the rendered rows [y0, y0 + band.res.y). Bands have to arrive
+  // from the last rendered row to the first, which is image order.
+  virtual bool write(const trm::Film &band, unsigned y0) = 0;
+  virtual bool close() = 0;
+};
+
+// Tone maps or resolves, encodes and writes films on a background thread in
+// the order they are pushed, so rendering can continue while the last image
+// is saved. At most `depth` films wait in the queue; push blocks beyond that.
+// The thread encodes as set up by `encode_alongside(threads)`.
+class ImageWriter {
+public:
+  explicit ImageWriter(std::size_t depth = 2, int threads = 0);
+  ~ImageWriter();
+
+  void push(const std::string &file_desc, trm::Film &&film,
+            int png_level = 6);
+  // Blocks until every pushed image has been written.
+  void flush();
+
+private:
+  struct Job {
+    std::string file_desc;
+    trm::Film film;
+    int png_level;
+  };
+  void run();
+
+  std::size_t depth_;
+  int threads_;
+  std::queue<Job> jobs_;
+  bool busy_ = false, stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+};
+
+#endif // TRM_IMG_HPP_
@@ -0,0 +1,150 @@
+#include "kernel.hpp"
+
+#include <string>
+
+#include "approx.hpp"
+#include "sdf.hpp"
+#include "type.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRM_KERNEL_X86
+#endif
+
+// Every instruction set gets its own copy of the kernels through the target
+// attribute instead of a file built with other -m flags: inline functions of
+// the headers that a kernel calls without inlining keep their baseline code,
+// so the linker can not pick a copy built for a newer set for the rest of the
+// program. `flatten` inlines everything the node does into the kernel, the
+// fractal iterations included, for as far as the node's children.
+#define TRM_KERNEL_NS baseline
+#ifdef __GNUC__
+#define TRM_KERNEL_TARGET __attribute__((flatten))
+#else
+#define TRM_KERNEL_TARGET
+#endif
+#include "kernel.inl"
+#undef TRM_KERNEL_NS
+#undef TRM_KERNEL_TARGET
+
+#ifdef TRM_KERNEL_X86
+#define TRM_KERNEL_NS sse42
+#define TRM_KERNEL_TARGET __attribute__((target("sse4.2,popcnt"), flatten))
+#include "kernel.inl"
+#undef TRM_KERNEL_NS
+#undef TRM_KERNEL_TARGET
+
+#define TRM_KERNEL_NS avx2
+#define TRM_KERNEL_TARGET                                                      \
+  __attribute__((target("avx2,fma,bmi,bmi2,popcnt"), flatten))
+#include "kernel.inl"
+#undef TRM_KERNEL_NS
+#undef TRM_KERNEL_TARGET
+
+#define TRM_KERNEL_NS avx512
+#define TRM_KERNEL_TARGET                                                      \
+  __attribute__((                                                              \
+      target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,bmi,bmi2,popcnt"), \
+      flatten))
+#include "kernel.inl"
+#undef TRM_KERNEL_NS
+#undef TRM_KERNEL_TARGET
+#endif
+
+namespace {
+trm::kernel::Isa active = trm::kernel::BASELINE;
+bool active_fast = false;
+const char *names[] = {"baseline", "sse4.2", "avx2", "avx512"};
+
+bool supported(trm::kernel::Isa isa) {
+#ifdef TRM_KERNEL_X86
+  __builtin_cpu_init();
+  switch (isa) {
+  case trm::kernel::BASELINE:
+    return true;
+  case trm::kernel::SSE42:
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+  case trm::kernel::AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+           __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+           supported(trm::kernel::SSE42);
+  case trm::kernel::AVX512:
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512dq") && supported(trm::kernel::AVX2);
+  }
+  return false;
+#else
+  return isa == trm::kernel::BASELINE;
+#endif
+}
+} // namespace
+
+trm::kernel::Isa trm::kernel::detect() {
+  Isa best = BASELINE;
+  for (Isa isa : {SSE42, AVX2, AVX512}) {
+    if (supported(isa))
+      best = isa;
+  }
+  return best;
+}
+
+bool trm::kernel::parse_isa(const std::string &str, Isa *isa) {
+  if (str == "" || str == "auto") {
+    *isa = detect();
+    return true;
+  }
+  for (Isa candidate : {BASELINE, SSE42, AVX2, AVX512}) {
+    if (str == names[candidate]) {
+      *isa = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *trm::kernel::name(Isa isa) { return names[isa]; }
+
+bool trm::kernel::select(Isa isa) {
+  if (!supported(isa))
+    return false;
+  active = isa;
+  return true;
+}
+
+trm::kernel::Isa trm::kernel::selected() { return active; }
+
+trm::kernel::Isa trm::kernel::equivalent(Isa isa) {
+  bool fused = isa >= AVX2;
+  Isa best = isa;
+  for (Isa candidate : {BASELINE, SSE42, AVX2, AVX512}) {
+    if ((candidate >= AVX2) == fused && supported(candidate))
+      best = candidate;
+  }
+  return best;
+}
+
+void trm::kernel::set_fast_math(bool fast) { active_fast = fast; }
+
+bool trm::kernel::fast_math() { return active_fast; }
+
+const trm::kernel::Entry *trm::kernel::entry(SdfKind kind, bool fast) {
+  using approx::Exact;
+  using approx::Fast;
+  switch (active) {
+#ifdef TRM_KERNEL_X86
+  case SSE42:
+    return fast ? sse42::entry<Fast>(kind) : sse42::entry<Exact>(kind);
+  case AVX2:
+    return fast ? avx2::entry<Fast>(kind) : avx2::entry<Exact>(kind);
+  case AVX512:
+    return fast ? avx512::entry<Fast>(kind) : avx512::entry<Exact>(kind);
+#endif
+  default:
+    return fast ? baseline::entry<Fast>(kind) : baseline::entry<Exact>(kind);
+  }
+}
+
+const trm::kernel::Entry *trm::kernel::entry(SdfKind kind) {
+  return entry(kind, active_fast);
+}
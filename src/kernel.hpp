@@ -0,0 +1,46 @@
+#ifndef TRM_KERNEL_HPP_
+#define TRM_KERNEL_HPP_
+
+#include <string>
+
+#include "sdf.hpp"
+#include "type.hpp"
+
+namespace trm {
+namespace kernel {
+  // Instruction sets the evaluation kernels are compiled for, each one a
+  // superset of the ones before it.
+  enum Isa { BASELINE, SSE42, AVX2, AVX512 };
+
+  // `dist` and bounded `dist` of one kind of node, for the node passed in.
+  struct Entry {
+    Float (*dist)(const Sdf &node, const Vec3 &p);
+    Float (*bounded)(const Sdf &node, const Vec3 &p, Float cutoff);
+  };
+
+  // Newest instruction set both the CPU and the operating system support.
+  Isa detect();
+  // Accepts the names `name` gives, and "" or "auto" for `detect()`.
+  bool parse_isa(const std::string &str, Isa *isa);
+  const char *name(Isa isa);
+  // Makes `entry` return the kernels compiled for `isa`, which fails if the
+  // CPU does not support it. Nodes bound before keep their kernels.
+  bool select(Isa isa);
+  Isa selected();
+  // Newest instruction set the CPU supports whose kernels round the same way
+  // as those of `isa`, so that they give the same values bit for bit: the
+  // sets with fused multiply-adds agree with each other, and so do the sets
+  // without. `isa` itself when the CPU supports none of them.
+  Isa equivalent(Isa isa);
+  // Whether `entry` returns the kernels that use the approximations of
+  // approx.hpp. Nodes bound before keep their kernels.
+  void set_fast_math(bool fast);
+  bool fast_math();
+  // Kernels of the selected instruction set for nodes of `kind`, with the
+  // approximations or without.
+  const Entry *entry(SdfKind kind, bool fast);
+  const Entry *entry(SdfKind kind);
+} // namespace kernel
+} // namespace trm
+
+#endif // TRM_KERNEL_HPP_
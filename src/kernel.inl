@@ -0,0 +1,116 @@
+// Kernels of one instruction set, included by kernel.cpp once per set with
+// TRM_KERNEL_NS naming the namespace they go in and TRM_KERNEL_TARGET the
+// attributes they are compiled with.
+
+namespace trm {
+namespace kernel {
+  namespace TRM_KERNEL_NS {
+    // The qualified calls skip the virtual ones, so the node's code inlines
+    // into the kernel and is compiled for its instruction set.
+    template <typename Node>
+    TRM_KERNEL_TARGET Float dist(const Sdf &node, const Vec3 &p) {
+      return static_cast<const Node &>(node).Node::dist(p);
+    }
+    template <typename Node>
+    TRM_KERNEL_TARGET Float bounded(const Sdf &node, const Vec3 &p,
+                                    Float cutoff) {
+      return static_cast<const Node &>(node).Node::dist(p, cutoff);
+    }
+    // For nodes whose bounded `dist` is the one of `Sdf`.
+    template <typename Node>
+    TRM_KERNEL_TARGET Float unbounded(const Sdf &node, const Vec3 &p, Float) {
+      return static_cast<const Node &>(node).Node::dist(p);
+    }
+
+    // For nodes with math functions, through those of `Math`.
+    template <typename Node, typename Math>
+    TRM_KERNEL_TARGET Float approximated(const Sdf &node, const Vec3 &p) {
+      return static_cast<const Node &>(node).template eval<Math>(p);
+    }
+    template <typename Node, typename Math>
+    TRM_KERNEL_TARGET Float approximated_bounded(const Sdf &node,
+                                                 const Vec3 &p, Float cutoff) {
+      return static_cast<const Node &>(node).template eval<Math>(p, cutoff);
+    }
+
+    template <typename Node> const Entry *plain() {
+      static const Entry entry = {dist<Node>, unbounded<Node>};
+      return &entry;
+    }
+    template <typename Node> const Entry *cut() {
+      static const Entry entry = {dist<Node>, bounded<Node>};
+      return &entry;
+    }
+
+    template <typename Node, typename Math> const Entry *math() {
+      static const Entry entry = {approximated<Node, Math>, unbounded<Node>};
+      return &entry;
+    }
+    template <typename Node, typename Math> const Entry *math_cut() {
+      static const Entry entry = {approximated<Node, Math>,
+                                  approximated_bounded<Node, Math>};
+      return &entry;
+    }
+
+    // Kernels of the nodes of `kind` that take their math functions from
+    // `Math`. Nodes without any get the same kernels for every `Math`.
+    template <typename Math> const Entry *entry(SdfKind kind) {
+      switch (kind) {
+      case SdfKind::Sphere:
+        return plain<Sphere>();
+      case SdfKind::Box:
+        return plain<Box>();
+      case SdfKind::Cylinder:
+        return plain<Cylinder>();
+      case SdfKind::Torus:
+        return plain<Torus>();
+      case SdfKind::Plane:
+        return plain<Plane>();
+      case SdfKind::Pyramid:
+        return plain<Pyramid>();
+      case SdfKind::MengerSponge:
+        return cut<MengerSponge>();
+      case SdfKind::SerpinskiTetrahedron:
+        return plain<SerpinskiTetrahedron>();
+      case SdfKind::Kifs:
+        return plain<Kifs>();
+      case SdfKind::Mandelbulb:
+        return math<Mandelbulb, Math>();
+      case SdfKind::Mandelbox:
+        return plain<Mandelbox>();
+      case SdfKind::Elongate:
+        return cut<Elongate>();
+      case SdfKind::Round:
+        return cut<Round>();
+      case SdfKind::Onion:
+        return cut<Onion>();
+      case SdfKind::Union:
+        return cut<Union>();
+      case SdfKind::Subtraction:
+        return cut<Subtraction>();
+      case SdfKind::Intersection:
+        return cut<Intersection>();
+      case SdfKind::SmoothUnion:
+        return plain<SmoothUnion>();
+      case SdfKind::SmoothSubtraction:
+        return plain<SmoothSubtraction>();
+      case SdfKind::SmoothIntersection:
+        return plain<SmoothIntersection>();
+      case SdfKind::Repeat:
+        return cut<Repeat>();
+      case SdfKind::LimitedRepeat:
+        return cut<LimitedRepeat>();
+      case SdfKind::Mirror:
+        return cut<Mirror>();
+      case SdfKind::PolarRepeat:
+        return math_cut<PolarRepeat, Math>();
+      case SdfKind::Instance:
+        return cut<Instance>();
+      case SdfKind::MultiUnion:
+        return cut<MultiUnion>();
+      }
+      return nullptr;
+    }
+  } // namespace TRM_KERNEL_NS
+} // namespace kernel
+} // namespace trm
@@ -1,5 +1,12 @@
+#include <algorithm>
 #include <bits/c++config.h>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -17,16 +24,27 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <glob.h>
+#include <signal.h>
+
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+#include "approx.hpp"
 #include "argparse.hpp"
 #include "bar.hpp"
 #include "camera.hpp"
+#include "check.hpp"
+#include "cost.hpp"
+#include "farm.hpp"
+#include "film.hpp"
 #include "img.hpp"
 #include "interp.hpp"
+#include "kernel.hpp"
 #include "material.hpp"
+#include "numa.hpp"
+#include "pack.hpp"
 #include "prof.hpp"
 #include "rand.hpp"
 #include "scene.hpp"
@@ -40,17 +58,36 @@ using namespace glm;
 
 // Ray structure
 struct Ray {
-  Ray(const Vec3 &o, const Vec3 &d) : o(o), d(normalize(d)), medium(nullptr) {}
+  Ray(const Vec3 &o, const Vec3 &d)
+      : o(o), d(normalize(d)), medium(nullptr), inside(nullptr), cone(0.0f),
+        spread(0.0f) {}
   Ray(const Vec3 &o, const Vec3 &d,
-      const std::shared_ptr<trm::Material> &medium)
-      : o(o), d(normalize(d)), medium(medium) {}
+      const std::shared_ptr<trm::Material> &medium,
+      const trm::Sdf *inside = nullptr, Float cone = 0.0f,
+      Float spread = 0.0f)
+      : o(o), d(normalize(d)), medium(medium), inside(inside), cone(cone),
+        spread(spread) {}
   Vec3 o, d;
   std::shared_ptr<trm::Material> medium;
+  // Object the ray entered by refraction and travels inside of, if any.
+  const trm::Sdf *inside;
+  // Radius of the cone of space the ray stands for at its origin, and how
+  // much it grows per unit of distance.
+  Float cone, spread;
 };
 
 // Global Variables set from main
 static trm::RenderSettings settings;
 static trm::Scene scene;
+// Ray march steps taken by the calling thread, read by the cost pre-pass
+static thread_local std::size_t march_steps = 0;
+// NUMA node local copy of the scene used by the calling thread, if any
+static thread_local const trm::Scene *thread_scene = nullptr;
+static trm::numa::Topology topology;
+static std::vector<trm::Scene> replicas;
+static ImageWriter writer;
+// Signal that asked the render to stop, checked between pixels.
+static volatile sig_atomic_t interrupted = 0;
 
 void ons(const Vec3 &v1, Vec3 &v2, Vec3 &v3) {
   if (abs(v1.x) > abs(v1.y)) {
@@ -66,45 +103,235 @@ void ons(const Vec3 &v1, Vec3 &v2, Vec3 &v3) {
 Vec3 hemisphere(const Float &u1, const Float &u2) {
   const Float r = sqrt(1.0 - u1 * u1);
   const Float phi = 2 * M_PI * u2;
+  if (settings.fast_math) {
+    Float s, c;
+    trm::approx::sincos(phi, &s, &c);
+    return Vec3(c * r, s * r, u1);
+  }
   return Vec3(cos(phi) * r, sin(phi) * r, u1);
 }
 
-std::tuple<Float, std::shared_ptr<trm::Sdf>> sdfScene(const Vec3 &p) {
+// Lower bounds on the value of every object along the ray being marched,
+// and the march parameter each was taken at. An object that was at least `d`
+// at `t` is at least `d - lipschitz * (t' - t)` at `t'`.
+struct ObjectBounds {
+  std::vector<Float> dist, t;
+  // For segment tracing, the rate of change of every object along the ray,
+  // or negative until first needed, and how fast the value of every object
+  // can fall from `t` on, which replaces the Lipschitz bound above. Negative
+  // until the object was evaluated.
+  std::vector<Float> along, rate;
+  Vec3 d;
+};
+static thread_local ObjectBounds object_bounds;
+
+// Distance to the closest object at `p`, dividing values by the Lipschitz
+// bound of objects whose transforms shrink space so they never overshoot.
+// With `step`, also finds how far the ray can advance from `p` by dividing
+// values by how fast they can fall ahead of `p` instead, which is often far
+// less than the bound, and 0 for convex objects the ray has passed. Steps
+// aim just inside the hit distance rather than at the surface, where sphere
+// tracing would also stop.
+// Only the objects listed in `subset` are considered when it is set.
+std::tuple<Float, std::shared_ptr<trm::Sdf>>
+sdfScene(const Vec3 &p, Float t, ObjectBounds *bounds, Float *step = nullptr,
+         const std::vector<std::size_t> *subset = nullptr) {
   Float dist = std::numeric_limits<Float>::infinity();
+  Float advance = std::numeric_limits<Float>::infinity();
   std::shared_ptr<trm::Sdf> closest_obj = nullptr;
-  for (auto &obj : scene.objects) {
+  const trm::Scene &local = thread_scene != nullptr ? *thread_scene : scene;
+  std::size_t count = subset != nullptr ? subset->size() : local.objects.size();
+  for (std::size_t k = 0; k < count; ++k) {
+    std::size_t i = subset != nullptr ? (*subset)[k] : k;
+    const std::shared_ptr<trm::Sdf> &obj = local.objects[i];
     if (obj->mat == nullptr)
       continue;
-    Float obj_dist = abs((*obj)(p));
+    // Bounds within rounding of 1 come from rotations and are taken as 1.
+    Float lipschitz = obj->lipschitz;
+    Float norm = lipschitz > 1.001f ? lipschitz : 1.0f;
+    // Objects whose bound can not beat the closest so far are skipped, and
+    // the rest only have to tell whether they are closer, which lets them
+    // stop early.
+    Float fall = step != nullptr && bounds->rate[i] >= 0.0f ? bounds->rate[i]
+                                                            : lipschitz;
+    Float lower = bounds->dist[i] - 1.001f * fall * (t - bounds->t[i]);
+    Float target = 0.9f * settings.epsilon_distance * norm;
+    if (lower >= dist * norm &&
+        (step == nullptr || lower - target >= advance * 1.001f * fall))
+      continue;
+    Float cutoff = dist * norm, rate = 0.0f;
+    if (step != nullptr) {
+      if (bounds->along[i] < 0.0f)
+        bounds->along[i] = obj->lipschitz_along(bounds->d);
+      rate = bounds->rate[i] >= 0.0f ? bounds->rate[i] : bounds->along[i];
+      if (rate > 0.0f)
+        cutoff = max(cutoff, advance * rate + target);
+    }
+    // Coarser fractal levels further along a ray can swallow the point it
+    // has reached from outside, which is taken as a hit rather than marched
+    // through.
+    Float signed_value = (*obj)(p, cutoff);
+    Float value = trm::lod_footprint > 0.0f ? max(signed_value, 0.0f)
+                                            : abs(signed_value);
+    bounds->dist[i] = value;
+    bounds->t[i] = t;
+    if (step != nullptr) {
+      // Inside, the distance falls where the value grows, which only the
+      // directional bound limits. Any bound taken earlier on the ray still
+      // holds from here on.
+      if (signed_value < 0.0f)
+        rate = bounds->along[i];
+      else if (rate > 0.0f)
+        rate = min(rate, obj->rate_from(p, bounds->d));
+      bounds->rate[i] = rate;
+    }
+    Float obj_dist = value / norm;
     if (obj_dist < dist) {
       dist = obj_dist;
       closest_obj = obj;
     }
+    if (step != nullptr && rate > 0.0f && value - target < advance * rate)
+      advance = (value - target) / rate;
   }
+  if (step != nullptr)
+    *step = max(advance, dist);
   return std::make_tuple(dist, closest_obj);
 }
 
-std::tuple<Float, std::shared_ptr<trm::Sdf>> rayMarch(const Ray &r,
-                                                      Float *safe_depth) {
+// Moves a hit found within the march epsilon onto the surface of `obj`. Its
+// signed value is followed by secant steps from the two last march points,
+// then by false position once a step has crossed the surface. Steps that
+// leave the neighbourhood of the hit, as for rays grazing past a surface,
+// end the search, and the parameter with the smallest value seen is kept.
+Float refine_hit(const Ray &r, const trm::Sdf &obj, Float t0, Float t1) {
+  Float f0 = obj(r.o + t0 * r.d), f1 = obj(r.o + t1 * r.d);
+  Float best = t1, best_value = abs(f1);
+  Float reach = 10.0f * settings.epsilon_distance;
+  bool bracketed = false;
+  for (std::size_t i = 0; i < settings.refine_steps && f1 != 0.0f; ++i) {
+    if (f1 == f0)
+      break;
+    Float t = t1 - f1 * (t1 - t0) / (f1 - f0);
+    if (!bracketed && (t < t0 || t > best + reach))
+      break;
+    Float f = obj(r.o + t * r.d);
+    if (abs(f) < best_value) {
+      best = t;
+      best_value = abs(f);
+    }
+    if ((f < 0.0f) != (f1 < 0.0f)) {
+      bracketed = true;
+      t0 = t1;
+      f0 = f1;
+    } else if (bracketed) {
+      // Illinois variant, so the end that stays put does not stall the
+      // search.
+      f0 *= 0.5f;
+    } else {
+      t0 = t1;
+      f0 = f1;
+    }
+    t1 = t;
+    f1 = f;
+  }
+  return best;
+}
+
+// Marches `r` to the first object closer than the epsilon, or to the nearest
+// analytic object if that comes first. With `surface`,
+// the hit is also refined onto the surface and its parameter stored there,
+// while the returned one stays where the march stopped, off the surface,
+// where normals are well defined. Secondary rays pass the object they leave
+// as `from`, whose surface they start on, and ignore it while its value keeps
+// growing within the epsilon. Rays inside a refractive object only consider
+// the objects of its medium until they leave its enclosing sphere, since
+// the object's own surface is nearer than any other.
+std::tuple<Float, std::shared_ptr<trm::Sdf>>
+rayMarch(const Ray &r, Float *safe_depth, const trm::Sdf *from = nullptr,
+         Float *surface = nullptr) {
   Float dist = 0.0;
   Float delta_dist = 0.0;
   bool not_safe = false;
   std::shared_ptr<trm::Sdf> obj = nullptr;
-  for (dist = 0.0; dist < settings.maximum_distance; dist += delta_dist) {
-    std::tie(delta_dist, obj) = sdfScene(r.o + dist * r.d);
+  const trm::Scene &local = thread_scene != nullptr ? *thread_scene : scene;
+  ObjectBounds &bounds = object_bounds;
+  bounds.dist.assign(local.objects.size(),
+                     -std::numeric_limits<Float>::infinity());
+  bounds.t.assign(local.objects.size(), 0.0f);
+  Float step = 0.0f;
+  Float *segment = nullptr;
+  if (settings.segment_tracing) {
+    bounds.along.assign(local.objects.size(), -1.0f);
+    bounds.rate.assign(local.objects.size(), -1.0f);
+    bounds.d = r.d;
+    segment = &step;
+  }
+  // Marching stops at the nearest analytic hit. A ray leaving one of them
+  // only meets it again beyond the epsilon, as when it goes through.
+  Float limit = settings.maximum_distance;
+  std::shared_ptr<trm::Sdf> nearest = nullptr;
+  for (auto &shape : local.analytic) {
+    Float t = trm::intersect(*shape, r.o, r.d,
+                             shape.get() == from ? settings.epsilon_distance
+                                                 : 0.0f);
+    if (t < limit) {
+      limit = t;
+      nearest = shape;
+    }
+  }
+  const trm::Medium *medium = nullptr;
+  if (r.inside != nullptr) {
+    auto it = local.media.find(r.inside);
+    if (it != local.media.end())
+      medium = &it->second;
+  }
+  Float prev = 0.0f, advance = 0.0f, last = -1.0f;
+  for (dist = 0.0; dist < limit; prev = dist, dist += advance) {
+    march_steps++;
+    Vec3 p = r.o + dist * r.d;
+    // Rays inside objects keep every detail, as coarser levels are not
+    // lower bounds there.
+    if (settings.lod > 0.0f)
+      trm::lod_footprint = r.medium == nullptr
+                               ? settings.lod * (r.cone + r.spread * dist)
+                               : 0.0f;
+    if (medium != nullptr && length(p - medium->center) > medium->radius)
+      medium = nullptr;
+    std::tie(delta_dist, obj) =
+        sdfScene(p, dist, &bounds, segment,
+                 medium != nullptr ? &medium->objects : nullptr);
+    advance = segment != nullptr ? step : delta_dist;
     if (!not_safe && safe_depth != nullptr &&
         delta_dist < settings.inter_pixel_arc) {
       *safe_depth = dist;
       not_safe = true;
     }
     if (delta_dist < settings.epsilon_distance) {
+      if (obj.get() == from && delta_dist > last) {
+        // Steps double up to the offset secondary rays used to start at, and
+        // go on by the epsilon after that.
+        Float eps = settings.epsilon_distance, reach = 10.0f * eps;
+        last = delta_dist;
+        advance = max(advance, dist < reach ? max(min(dist, reach - dist), eps)
+                                            : eps);
+        continue;
+      }
+      if (surface != nullptr)
+        *surface = refine_hit(r, *obj, prev, dist);
       return std::make_tuple(dist, obj);
     }
+    from = nullptr;
+  }
+  if (nearest != nullptr) {
+    if (surface != nullptr)
+      *surface = limit;
+    return std::make_tuple(limit, nearest);
   }
   return std::make_tuple(dist, nullptr);
 }
 
-Vec3 trace(const Ray &r, Float *safe_depth, std::size_t depth = 0) {
+Vec3 trace(const Ray &r, Float *safe_depth, std::size_t depth = 0,
+           const trm::Sdf *from = nullptr) {
   Float rr_factor = 1.0;
   Vec3 color(0.0f);
   if (depth >= settings.maximum_depth) {
@@ -117,15 +344,31 @@ Vec3 trace(const Ray &r, Float *safe_depth, std::size_t depth = 0) {
   }
   Float t;
   std::shared_ptr<trm::Sdf> obj;
-  std::tie(t, obj) = rayMarch(r, safe_depth);
+  Float surface = 0.0f;
+  bool refine = settings.refine_steps != 0;
+  std::tie(t, obj) =
+      rayMarch(r, safe_depth, from, refine ? &surface : nullptr);
   if (obj == nullptr)
     return color;
 
-  Vec3 hp = r.o + r.d * t;
-  Vec3 n = obj->normal(hp);
+  Vec3 n = obj->normal(r.o + r.d * t);
+  // Refined hits lie on the surface, and secondary rays leave from there
+  // instead of being pushed off it.
+  Vec3 hp = r.o + r.d * (refine ? surface : t);
+  const trm::Sdf *leave = refine ? obj.get() : nullptr;
+  Float offset = refine ? 0.0f : 10.0f * settings.epsilon_distance;
+  // Secondary rays carry on the cone of the primary one, taking no account
+  // of the curvature of the surface.
+  Float cone = r.cone + r.spread * t;
 
   const Float emission = obj->mat->emission;
-  color = emission * obj->mat->color * rr_factor;
+  Vec3 albedo = obj->mat->color;
+  if (obj->mat->trap) {
+    Float trap = trm::orbit_trap(*obj, r.o + r.d * t);
+    if (trap >= 0.0f)
+      albedo = mix(obj->mat->trap_color, albedo, min(trap, Float(1.0f)));
+  }
+  color = emission * albedo * rr_factor;
 
   if (obj->mat->type == trm::Material::DIFF) {
     Vec3 rotx, roty;
@@ -136,102 +379,641 @@ Vec3 trace(const Ray &r, Float *safe_depth, std::size_t depth = 0) {
     rotated_dir.y = dot(Vec3(rotx.y, roty.y, n.y), sampled_dir);
     rotated_dir.z = dot(Vec3(rotx.z, roty.z, n.z), sampled_dir);
     Float cost = dot(rotated_dir, n);
-    color += trace({hp + (10.0f * settings.epsilon_distance * rotated_dir),
-                    rotated_dir, r.medium},
-                   nullptr, depth + 1) *
-             obj->mat->color * cost * rr_factor * 0.25f; // Should be 0.1f
+    color += trace({hp + offset * rotated_dir, rotated_dir, r.medium,
+                    r.inside, cone, r.spread},
+                   nullptr, depth + 1, leave) *
+             albedo * cost * rr_factor * 0.25f; // Should be 0.1f
   } else if (obj->mat->type == trm::Material::SPEC) {
     Vec3 new_dir = normalize(reflect(r.d, n));
-    color += trace({hp + (10.0f * settings.epsilon_distance * new_dir), new_dir,
-                    r.medium},
-                   nullptr, depth + 1) *
+    color += trace({hp + offset * new_dir, new_dir, r.medium, r.inside, cone,
+                    r.spread},
+                   nullptr, depth + 1, leave) *
              rr_factor;
   } else if (obj->mat->type == trm::Material::REFR) {
     Vec3 new_dir =
         refract(r.d, (r.medium == obj->mat) ? -n : n,
                 (r.medium != nullptr) ? (r.medium->ior / obj->mat->ior)
                                       : (1.0f / obj->mat->ior));
-    color += trace({hp + (10.0f * settings.epsilon_distance * new_dir), new_dir,
-                    (r.medium != nullptr && r.medium == obj->mat) ? nullptr
-                                                                  : obj->mat},
-                   nullptr, depth + 1) *
+    bool exits = r.medium != nullptr && r.medium == obj->mat;
+    color += trace({hp + offset * new_dir, new_dir,
+                    exits ? nullptr : obj->mat, exits ? nullptr : obj.get(),
+                    cone, r.spread},
+                   nullptr, depth + 1, leave) *
              1.15f * rr_factor;
   }
   return color;
 }
 
-void render(const std::string &file_path) {
+struct View {
+  Mat4 view;
+  Float filmz;
+  Vec3 origin;
+};
+
+View setup_view() {
+  View v;
+  v.view =
+      inverse(lookAtLH(scene.camera.pos, scene.camera.center, scene.camera.up));
+  v.filmz = settings.resolution.x / (2.0f * tan(scene.camera.fov / 2.0f));
+  v.origin = v.view * Vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  settings.inter_pixel_arc = sqrt(2.0f) / v.filmz;
+  return v;
+}
+
+// Every sample reseeds the generator from the pixel and sample index, so a
+// pixel's value does not depend on which thread or process renders it, and
+// samples [begin, end) continue exactly where an earlier render stopped.
+Vec3 render_samples(const View &v, std::size_t x, std::size_t y,
+                    std::size_t begin, std::size_t end) {
+  PROF_SCOPED("pixel", "renderer");
+  unsigned resx = settings.resolution.x, resy = settings.resolution.y;
+  std::size_t i = y * resx + x;
+  vec3 sum(0.0f, 0.0f, 0.0f);
+  Float safe_depth = 0.0f;
+  for (std::size_t s = begin; s < end; ++s) {
+    trm::seed(settings.seed, i, s);
+    Ray ray(v.origin, v.view * Vec4(x - resx / 2.0f + trm::frand(),
+                                    y - resy / 2.0f + trm::frand(), v.filmz,
+                                    0.0f));
+    ray.spread = settings.inter_pixel_arc / 2.0f;
+    sum += trace(ray, &safe_depth);
+  }
+  return sum;
+}
+
+void render_tile(const trm::farm::Tile &tile, trm::Film *film) {
+  PROF_FUNC("renderer", "x0", tile.x0, "y0", tile.y0, "x1", tile.x1, "y1",
+            tile.y1);
+  View v = setup_view();
+  std::size_t width = tile.x1 - tile.x0;
+#pragma omp parallel for schedule(dynamic, 256) shared(film)
+  for (std::size_t i = 0; i < tile.size(); ++i) {
+    film->add(i,
+              render_samples(v, tile.x0 + i % width, tile.y0 + i / width, 0,
+                             settings.spp),
+              settings.spp);
+  }
+}
+
+// Pins every OpenMP thread according to `--affinity` and, with
+// `--replicate`, points it at a copy of the scene made by the first thread
+// that runs on its node, so scene data is first touched node locally.
+void setup_threads() {
+  trm::numa::Affinity affinity = trm::numa::NONE;
+  trm::numa::parse_affinity(settings.affinity, &affinity);
+  replicas.clear();
+  replicas.resize(settings.replicate ? topology.nodes.size() : 0);
+  std::vector<bool> copied(replicas.size(), false);
+#pragma omp parallel shared(copied)
+  {
+#ifdef _OPENMP
+    int thread = omp_get_thread_num();
+#else
+    int thread = 0;
+#endif
+    trm::numa::pin(trm::numa::cpu_for(topology, affinity, thread));
+    int node = topology.node_of(trm::numa::current_cpu());
+    thread_scene = nullptr;
+    bool copy = false;
+    if (settings.replicate) {
+#pragma omp critical
+      {
+        copy = !copied[node];
+        copied[node] = true;
+      }
+    }
+    if (copy)
+      trm::copy_scene(scene, &replicas[node]);
+#pragma omp barrier
+    if (settings.replicate)
+      thread_scene = &replicas[node];
+  }
+}
+
+// Traces one sample through the center of every `prepass_scale` square of
+// pixels and records how many march steps its whole path took.
+trm::cost::CostMap prepass(const View &v) {
+  PROF_FUNC("renderer");
+  trm::cost::CostMap map;
+  map.scale = std::max<std::size_t>(1, settings.prepass_scale);
+  map.res = max(settings.resolution / uvec2(map.scale), uvec2(1));
+  map.steps.resize(std::size_t(map.res.x) * map.res.y);
+  unsigned resx = settings.resolution.x, resy = settings.resolution.y;
+  Float half = map.scale / 2.0f;
+  auto start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(dynamic, 16)
+  for (std::size_t i = 0; i < map.steps.size(); ++i) {
+    Float x = (i % map.res.x) * map.scale + half;
+    Float y = (i / map.res.x) * map.scale + half;
+    trm::seed(settings.seed, i, std::numeric_limits<uint64_t>::max() - 1);
+    march_steps = 0;
+    Float safe_depth = 0.0f;
+    Ray ray(v.origin,
+            v.view * Vec4(x - resx / 2.0f, y - resy / 2.0f, v.filmz, 0.0f));
+    ray.spread = settings.inter_pixel_arc / 2.0f;
+    trace(ray, &safe_depth);
+    map.steps[i] = march_steps;
+  }
+  map.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  return map;
+}
+
+// Renders bands of `stream_rows` rows from the top of the image down and
+// hands each finished band to a streaming encoder, which writes it while the
+// next band renders, so memory use is bounded by two bands.
+void render_stream(const std::string &file_path, const View &v) {
+  PROF_FUNC("renderer");
+  unsigned resx = settings.resolution.x, resy = settings.resolution.y;
+  std::unique_ptr<StreamWriter> out =
+      StreamWriter::open(file_path, settings.resolution, settings.png_level);
+  if (out == nullptr)
+    return;
+  ProgressBar bar(std::size_t(resy) * resx, file_path, !settings.no_bar);
+  bar.unit_scale = true;
+  bar.unit = "px";
+
+  unsigned rows = std::min<std::size_t>(settings.stream_rows, resy);
+  trm::Film bands[2];
+  std::future<bool> pending;
+  bool ok = true;
+  std::size_t b = 0;
+  for (unsigned y1 = resy; y1 > 0; y1 = y1 > rows ? y1 - rows : 0, b ^= 1) {
+    if (interrupted)
+      break;
+    unsigned y0 = y1 > rows ? y1 - rows : 0;
+    trm::Film &band = bands[b];
+    band = trm::Film(uvec2(resx, y1 - y0));
+#pragma omp parallel for schedule(dynamic, 256) shared(band, bar)
+    for (std::size_t i = 0; i < band.size(); ++i) {
+      band.add(i,
+               render_samples(v, i % resx, y0 + i / resx, 0, settings.spp),
+               settings.spp);
+#pragma omp critical
+      if (i % 128 == 0)
+        bar.update(std::min<std::size_t>(128, band.size() - i));
+    }
+    if (pending.valid())
+      ok = pending.get() && ok;
+    pending = std::async(std::launch::async, [&out, &band, y0]() {
+      encode_alongside();
+      return out->write(band, y0);
+    });
+  }
+  if (pending.valid())
+    ok = pending.get() && ok;
+  ok = out->close() && ok;
+  if (!ok)
+    std::fprintf(stderr, "Failed to write \"%s\"\n", file_path.c_str());
+  bar.finish();
+}
+
+void render(const std::string &file_path,
+            const std::vector<std::string> &argv) {
   PROF_FUNC("renderer");
+  View v = setup_view();
+  if (settings.stream_rows != 0) {
+    render_stream(file_path, v);
+    return;
+  }
+  unsigned resx = settings.resolution.x, resy = settings.resolution.y;
+
+  std::vector<trm::farm::Tile> tiles;
+  std::size_t tile_count = settings.tiles;
+  if (settings.farm_workers != 0 && settings.farm_tiles != 0) {
+    tile_count = settings.farm_tiles;
+  } else if (settings.farm_workers != 0) {
+    tile_count = 8 * settings.farm_workers;
+  }
+  if (settings.prepass) {
+    trm::cost::CostMap map = prepass(v);
+    if (tile_count == 0) {
+#ifdef _OPENMP
+      tile_count = 16 * omp_get_max_threads();
+#else
+      tile_count = 16;
+#endif
+    }
+    tiles = trm::cost::partition(map, settings.resolution, tile_count);
+    std::printf("Pre-pass:       %ux%u, %.0f steps in %.2fs\n", map.res.x,
+                map.res.y, map.total(), map.seconds);
+    std::printf("Estimated time: %s\n",
+                ProgressBar::format_interval(
+                    map.estimate(settings.resolution, settings.spp))
+                    .c_str());
+  } else if (tile_count != 0) {
+    tiles = trm::farm::split(settings.resolution, tile_count);
+  }
+
   ProgressBar bar(settings.resolution.y * settings.resolution.x, file_path,
                   !settings.no_bar);
   bar.unit_scale = true;
   bar.unit = "px";
-  uint8_t *buffer = (uint8_t *)malloc(
-      sizeof(uint8_t) * 3 * settings.resolution.x * settings.resolution.y);
+  trm::Film film;
 
-  Mat4 view =
-      inverse(lookAtLH(scene.camera.pos, scene.camera.center, scene.camera.up));
-  Float filmz = settings.resolution.x / (2.0f * tan(scene.camera.fov / 2.0f));
-  Vec3 origin = view * Vec4(0.0f, 0.0f, 0.0f, 1.0f);
-  settings.inter_pixel_arc = sqrt(2.0f) / filmz;
+  // Periodic checkpoints are taken between tiles, and first touch places
+  // pages per tile.
+  if ((settings.first_touch || settings.checkpoint_interval != 0) &&
+      settings.farm_workers == 0 && tiles.size() == 0) {
+#ifdef _OPENMP
+    tiles = trm::farm::split(settings.resolution, 16 * omp_get_max_threads());
+#else
+    tiles = trm::farm::split(settings.resolution, 16);
+#endif
+  }
+  if (settings.first_touch && settings.farm_workers == 0) {
+    // Same static schedule as the tile loop below, so each tile's pages are
+    // first touched by the thread that renders it.
+    film.allocate(settings.resolution);
+#pragma omp parallel for schedule(static, 1) shared(film)
+    for (std::size_t t = 0; t < tiles.size(); ++t) {
+      const trm::farm::Tile &tile = tiles[t];
+      for (unsigned y = tile.y0; y < tile.y1; ++y) {
+        film.clear(std::size_t(y) * resx + tile.x0,
+                   std::size_t(y) * resx + tile.x1);
+      }
+    }
+  } else {
+    film = trm::Film(settings.resolution);
+  }
+#ifdef _OPENMP
+  omp_set_schedule(settings.first_touch ? omp_sched_static : omp_sched_dynamic,
+                   1);
+#endif
 
-  unsigned resx = settings.resolution.x, resy = settings.resolution.y;
-  unsigned spp = settings.spp;
-
-  // for (std::size_t j = 0; j < resx * resy / 128; ++j) {
-  //   for (std::size_t k = 0; k < 128; ++k) {
-  //     std::size_t i = j * 128 + k;
-  //     PROF_SCOPED("pixel", "renderer");
-  //     std::size_t x = i % resx;
-  //     std::size_t y = i / resx;
-  //     vec3 color(0.0f, 0.0f, 0.0f);
-  //     Float safe_depth = 0.0f;
-  //     for (std::size_t s = 0; s < spp; ++s) {
-  //       Ray ray(origin,
-  //               view * Vec4(x - resx / 2.0f + trm::frand(),
-  //                           y - resy / 2.0f + trm::frand(), filmz, 0.0f));
-  //       color += trace(ray, &safe_depth) / Float(spp);
-  //     }
-  //     buffer[(i * 3) + 0] = clamp(color.r, 0.0f, 1.0f) * 255;
-  //     buffer[(i * 3) + 1] = clamp(color.g, 0.0f, 1.0f) * 255;
-  //     buffer[(i * 3) + 2] = clamp(color.b, 0.0f, 1.0f) * 255;
-  //   }
-  // }
-#pragma omp parallel for schedule(dynamic, 256) shared(buffer, bar)
-  for (std::size_t i = 0; i < resx * resy; ++i) {
-    PROF_SCOPED("pixel", "renderer");
-    std::size_t x = i % resx;
-    std::size_t y = i / resx;
-    vec3 color(0.0f, 0.0f, 0.0f);
-    Float safe_depth = 0.0f;
-    for (std::size_t s = 0; s < spp; ++s) {
-      Ray ray(origin, view * Vec4(x - resx / 2.0f + trm::frand(),
-                                  y - resy / 2.0f + trm::frand(), filmz, 0.0f));
-      color += trace(ray, &safe_depth) / Float(spp);
+  const std::string checkpoint = file_path + ".ckpt";
+  const trm::CheckpointKey key = {settings.resolution, settings.seed,
+                                  settings.spp, scene.source};
+  if (settings.resume && settings.farm_workers == 0 &&
+      file_exists(checkpoint)) {
+    // The key is checked before any pixel is read into the film.
+    trm::CheckpointKey stored;
+    if (!trm::read_checkpoint(checkpoint, &stored) || stored != key ||
+        !trm::read_checkpoint(checkpoint, &stored, &film)) {
+      std::fprintf(stderr, "Checkpoint \"%s\" does not match this render\n",
+                   checkpoint.c_str());
+      return;
+    }
+    std::size_t done = 0, finished = 0;
+    for (std::size_t i = 0; i < film.size(); ++i) {
+      done += std::min<std::size_t>(film.samples[i], settings.spp);
+      finished += film.samples[i] >= settings.spp;
+    }
+    std::printf("Resuming:       %.1f%% of samples done\n",
+                100.0 * done / (double(film.size()) * settings.spp));
+    // The bar counts pixels, and only those still rendered below.
+    bar.n = bar.initial = finished;
+    bar.display();
+  }
+  // Samples a pixel still needs, added from where its last render stopped.
+  auto render_rest = [&v, &film](std::size_t x, std::size_t y,
+                                 trm::Film *out, std::size_t i) {
+    std::size_t done = film.samples[y * film.res.x + x];
+    if (done < settings.spp) {
+      out->add(i, render_samples(v, x, y, done, settings.spp),
+               settings.spp - done);
     }
-    buffer[(i * 3) + 0] = clamp(color.r, 0.0f, 1.0f) * 255;
-    buffer[(i * 3) + 1] = clamp(color.g, 0.0f, 1.0f) * 255;
-    buffer[(i * 3) + 2] = clamp(color.b, 0.0f, 1.0f) * 255;
+  };
+  // Pixels of [begin, end) in `film` that still need samples.
+  auto unfinished = [&film](std::size_t begin, std::size_t end) {
+    std::size_t count = 0;
+    for (std::size_t i = begin; i < end; ++i)
+      count += film.samples[i] < settings.spp;
+    return count;
+  };
+
+  if (settings.farm_workers != 0) {
+    bool ok = trm::farm::coordinate(
+        settings.spool_dir != "" ? settings.spool_dir : file_path + ".spool",
+        tiles, settings, scene, argv, &film,
+        [&bar](const trm::farm::Tile &tile) { bar.update(tile.size()); });
+    if (!ok) {
+      std::fprintf(stderr, "Farm render of \"%s\" failed\n",
+                   file_path.c_str());
+      return;
+    }
+  } else if (tiles.size() != 0) {
+    // Tiles are rendered into their own film and added to the image under a
+    // lock, so a checkpoint never sees a pixel half written. Tiles arrive
+    // most expensive first, so the cheap ones fill in the gaps at the end of
+    // the render.
+    // Checkpoints are written from a copy taken under the lock, so the other
+    // threads only wait for the copy and not for the disk.
+    std::mutex film_mutex;
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    bool checkpointing = false;
+#pragma omp parallel for schedule(runtime) \
+    shared(film, bar, film_mutex, checkpointing)
+    for (std::size_t t = 0; t < tiles.size(); ++t) {
+      const trm::farm::Tile &tile = tiles[t];
+      if (interrupted)
+        continue;
+      trm::Film local(uvec2(tile.x1 - tile.x0, tile.y1 - tile.y0));
+      std::size_t pixels = 0;
+      for (unsigned y = tile.y0; y < tile.y1; ++y)
+        pixels += unfinished(y * resx + tile.x0, y * resx + tile.x1);
+      for (std::size_t i = 0; i < tile.size() && !interrupted; ++i) {
+        render_rest(tile.x0 + i % local.res.x, tile.y0 + i / local.res.x,
+                    &local, i);
+      }
+      trm::Film snapshot;
+      {
+        std::lock_guard<std::mutex> lock(film_mutex);
+        film.add(local, tile.x0, tile.y0);
+        auto now = std::chrono::steady_clock::now();
+        if (settings.checkpoint_interval != 0 && !checkpointing &&
+            now - last_checkpoint >=
+                std::chrono::seconds(settings.checkpoint_interval)) {
+          snapshot.allocate(film.res);
+          std::copy(film.rgb.get(), film.rgb.get() + 3 * film.size(),
+                    snapshot.rgb.get());
+          std::copy(film.samples.get(), film.samples.get() + film.size(),
+                    snapshot.samples.get());
+          checkpointing = true;
+          last_checkpoint = now;
+        }
+        bar.update(pixels);
+      }
+      if (snapshot.size() != 0) {
+        trm::write_checkpoint(checkpoint, snapshot, key);
+        std::lock_guard<std::mutex> lock(film_mutex);
+        checkpointing = false;
+      }
+    }
+  } else {
+#pragma omp parallel for schedule(dynamic, 256) shared(film, bar)
+    for (std::size_t i = 0; i < resx * resy; ++i) {
+      if (interrupted)
+        continue;
+      // Chunks start at multiples of 256, so the pixels counted are still
+      // ahead of this thread.
+      std::size_t pixels =
+          i % 128 == 0 ? unfinished(i, std::min<std::size_t>(i + 128,
+                                                             resx * resy))
+                       : 0;
+      render_rest(i % resx, i / resx, &film, i);
 #pragma omp critical
-    if (i % 128 == 0)
-      bar.update(128);
+      if (i % 128 == 0)
+        bar.update(pixels);
+    }
+  }
+  if (interrupted) {
+    if (trm::write_checkpoint(checkpoint, film, key)) {
+      std::printf("\nInterrupted, wrote checkpoint \"%s\"\n",
+                  checkpoint.c_str());
+    }
+  } else if (settings.farm_workers == 0 && file_exists(checkpoint)) {
+    std::remove(checkpoint.c_str());
   }
-  write_file(file_path, settings.resolution, buffer);
-  if (buffer != nullptr)
-    free(buffer);
+  writer.push(file_path, std::move(film), settings.png_level);
   bar.finish();
 }
 
+// Everything needed to render one scene file.
+struct Job {
+  trm::RenderSettings settings;
+  trm::Scene scene;
+  bool ok;
+};
+
+void apply_defaults(trm::RenderSettings *settings, trm::Scene *scene) {
+  if (scene->camera.fov == 0) {
+    scene->camera.fov = M_PI / 2.0f;
+  }
+  if (settings->resolution.x == 0 || settings->resolution.y == 0) {
+    settings->resolution = uvec2(500);
+  }
+  if (settings->maximum_depth == 0) {
+    settings->maximum_depth = 16;
+  }
+  if (settings->spp == 0) {
+    settings->spp = 32;
+  }
+  if (settings->output_fmt == "") {
+    settings->output_fmt = "out/{source}.png";
+  }
+}
+
+Job load_job(const std::string file, const trm::RenderSettings settings,
+             const trm::Camera camera) {
+  PROF_FUNC("main", "file", file);
+  Job job;
+  job.settings = settings;
+  job.scene.camera = camera;
+  job.ok = trm::load_scene(file, &job.settings, &job.scene);
+  if (job.ok)
+    apply_defaults(&job.settings, &job.scene);
+  return job;
+}
+
+std::string output_path(const Job &job) {
+  const std::string &source = job.scene.source;
+  return fmt::format(
+      job.settings.output_fmt, fmt::arg("spp", job.settings.spp),
+      fmt::arg("res", fmt::format("{}-{}", job.settings.resolution.x,
+                                  job.settings.resolution.y)),
+      fmt::arg("source",
+               source.substr(source.rfind('/') + 1,
+                             source.rfind('.') - source.rfind('/') - 1)));
+}
+
+// Expands glob patterns and "@file" arguments, which list one scene path or
+// pattern per line, into scene file paths.
+std::vector<std::string> expand_scenes(const std::vector<std::string> &args) {
+  std::vector<std::string> files;
+  std::function<void(const std::string &)> add =
+      [&files, &add](const std::string &arg) {
+        if (arg.size() > 1 && arg[0] == '@') {
+          std::ifstream list(arg.substr(1));
+          if (!list.is_open()) {
+            std::fprintf(stderr, "Failed to open scene list \"%s\"\n",
+                         arg.c_str() + 1);
+            return;
+          }
+          std::string line;
+          while (std::getline(list, line)) {
+            if (line.size() != 0 && line[0] != '#')
+              add(line);
+          }
+        } else if (arg.find_first_of("*?[") != std::string::npos) {
+          glob_t matches;
+          if (glob(arg.c_str(), 0, nullptr, &matches) == 0) {
+            for (std::size_t i = 0; i < matches.gl_pathc; ++i)
+              files.push_back(matches.gl_pathv[i]);
+          }
+          globfree(&matches);
+        } else {
+          files.push_back(arg);
+        }
+      };
+  for (auto &arg : args)
+    add(arg);
+  return files;
+}
+
+// Packs every scene next to its source file. Only the seed and the choice of
+// loader are taken from the command line, so the packed settings are the ones
+// the scene file gives.
+bool pack_scenes(const std::vector<std::string> &files, std::size_t seed,
+                 bool sax) {
+  bool ok = true;
+  for (auto &file : files) {
+    trm::RenderSettings packed;
+    packed.seed = seed;
+    trm::Scene loaded;
+    bool loaded_ok = sax ? trm::load_json_sax(file, &packed, &loaded)
+                         : trm::load_json(file, &packed, &loaded);
+    if (!loaded_ok) {
+      ok = false;
+      continue;
+    }
+    trm::merge_identical(&loaded.objects);
+    std::size_t ext = file.rfind('.');
+    if (ext == std::string::npos ||
+        (file.rfind('/') != std::string::npos && ext < file.rfind('/')))
+      ext = file.size();
+    std::string out = file.substr(0, ext) + ".trmb";
+    if (!trm::pack_scene(out, packed, loaded)) {
+      std::fprintf(stderr, "Failed to pack \"%s\"\n", out.c_str());
+      ok = false;
+      continue;
+    }
+    std::printf("Packed \"%s\" into \"%s\": %lu objects, %lu materials\n",
+                file.c_str(), out.c_str(), loaded.objects.size(),
+                loaded.materials.size());
+  }
+  return ok;
+}
+
+void print_scene(const trm::numa::Affinity &affinity) {
+  std::printf("Scene JSON:     \"%s\"\n", scene.source.c_str());
+#ifdef _OPENMP
+  std::printf("OpenMP Threads: %i\n", omp_get_max_threads());
+#else
+  std::printf("OpenMP:         DISABLED\n");
+#endif
+  std::printf("Kernels:        %s%s (CPU supports %s)\n",
+              trm::kernel::name(trm::kernel::selected()),
+              trm::kernel::fast_math() ? ", fast math" : "",
+              trm::kernel::name(trm::kernel::detect()));
+  std::printf("Settings:\n");
+  std::printf("  Resolution:    %ux%u\n", settings.resolution.x,
+              settings.resolution.y);
+  std::printf("  SPP:           %lu\n", settings.spp);
+  std::printf("  Depth:         %lu\n", settings.maximum_depth);
+  std::printf("  Seed:          %lu\n", settings.seed);
+  if (settings.farm_workers != 0) {
+    std::printf("  Farm Workers:  %lu\n", settings.farm_workers);
+  }
+  if (affinity != trm::numa::NONE) {
+    std::printf("  Affinity:      %s\n", settings.affinity.c_str());
+  }
+  std::printf("  Output Format: \"%s\"\n", settings.output_fmt.c_str());
+  std::printf("Scene:\n");
+  std::printf("  Camera:\n");
+  std::printf("    FOV:      %f\n", scene.camera.fov);
+  std::printf("    Position: %f, %f, %f\n", scene.camera.pos.x,
+              scene.camera.pos.y, scene.camera.pos.z);
+  std::printf("    Center:   %f, %f, %f\n", scene.camera.center.x,
+              scene.camera.center.y, scene.camera.center.z);
+  std::printf("    Up :      %f, %f, %f\n", scene.camera.up.x,
+              scene.camera.up.y, scene.camera.up.z);
+  std::printf("  Objects:   %lu\n", scene.objects.size());
+  std::printf("  Materials: %lu\n", scene.materials.size());
+  if (affinity != trm::numa::NONE || settings.replicate) {
+    std::printf("NUMA:           %lu nodes, %lu cpus\n", topology.nodes.size(),
+                topology.cpus());
+  }
+}
+
+// Renders the scene once per thread count (powers of two up to the OpenMP
+// maximum) and prints the wall clock time, speedup and parallel efficiency.
+void scaling_report(const std::string &file_path,
+                    const std::vector<std::string> &argv) {
+#ifdef _OPENMP
+  int max_threads = omp_get_max_threads();
+  std::vector<int> counts;
+  for (int n = 1; n < max_threads; n *= 2)
+    counts.push_back(n);
+  counts.push_back(max_threads);
+  std::vector<double> seconds;
+  for (auto &n : counts) {
+    if (interrupted)
+      return;
+    omp_set_num_threads(n);
+    setup_threads();
+    auto start = std::chrono::steady_clock::now();
+    render(file_path, argv);
+    seconds.push_back(std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+  }
+  double pixels = double(settings.resolution.x) * settings.resolution.y;
+  std::printf("Scaling (affinity: %s, replicate: %s, first touch: %s):\n",
+              settings.affinity != "" ? settings.affinity.c_str() : "none",
+              settings.replicate ? "yes" : "no",
+              settings.first_touch ? "yes" : "no");
+  std::printf("  %7s %10s %8s %10s %10s\n", "Threads", "Seconds", "Speedup",
+              "Efficiency", "Mpx/s");
+  for (std::size_t i = 0; i < counts.size(); ++i) {
+    std::printf("  %7d %10.3f %8.2f %9.1f%% %10.3f\n", counts[i], seconds[i],
+                seconds[0] / seconds[i],
+                100.0 * seconds[0] / (seconds[i] * counts[i]),
+                pixels / seconds[i] / 1e6);
+  }
+#else
+  std::printf("Scaling report requires OpenMP\n");
+  render(file_path, argv);
+#endif
+}
+
 int main(int argc, char *argv[]) {
   PROF_BEGIN("argparse", "main", "argc", argc, "argv",
              std::vector<std::string>(argv + 1, argv + argc));
 
   bool show_help = false;
-  std::string json_file = "";
+  std::vector<std::string> scene_args;
+
+  // `trm pack SceneJSON...` writes every scene as a packed ".trmb" file.
+  bool pack = argc > 1 && std::strcmp(argv[1], "pack") == 0;
+  // `trm check SceneJSON...` measures the errors of the fast math kernels.
+  bool check = argc > 1 && std::strcmp(argv[1], "check") == 0;
+  if (pack || check) {
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+  Float check_tolerance = 0.0f;
+  std::size_t check_samples = 10000;
 
   trm::argparse::Parser parser("Tiny Ray Marcher");
   parser.add("-h,--help", "show this help message", &show_help);
   parser.add("-o,--output", "output file path", &settings.output_fmt);
+  parser.add("--png-level", &settings.png_level,
+             "PNG compression level, 0 (stored) to 9");
+  parser.add("--checkpoint", &settings.checkpoint_interval,
+             "seconds between checkpoints of a render");
+  parser.add("--resume", &settings.resume,
+             "continue renders from their checkpoints");
+  parser.add("--sax", &settings.sax_loader,
+             "stream JSON scenes through a SAX parser instead of a DOM");
+  parser.add("--analytic", &settings.analytic,
+             "intersect top level planes, spheres and boxes in closed form "
+             "instead of marching them");
+  parser.add("--refine", &settings.refine_steps,
+             "refine hits onto the surface with up to N secant steps, which "
+             "allows a much larger --min");
+  parser.add("--lod", &settings.lod,
+             "stop fractal iterations whose detail is narrower than K times "
+             "the ray footprint, 0 for every iteration");
+  parser.add("--segment", &settings.segment_tracing,
+             "step by the rate of change of each object along the ray, "
+             "which takes longer steps past planes and stretched objects");
+  parser.add("--optimize", &settings.optimize,
+             "simplify the scene graph and drop unused objects and materials");
+  parser.add("--stream", &settings.stream_rows,
+             "render and write bands of N rows to bound memory use");
   parser.add("-s,--spp", &settings.spp, "samples per pixel");
   parser.add("--fov", &scene.camera.fov, "field of view");
   parser.add("--max", &settings.maximum_distance,
@@ -243,80 +1025,200 @@ int main(int argc, char *argv[]) {
   parser.add("-B,--no-bar", &settings.no_bar, "display fancy progress bar");
   parser.add("-r,--res,--resolution", &settings.resolution,
              "resolution of output image");
-  parser.add("SceneJSON", &json_file, "scene specification json");
+  parser.add("--seed", &settings.seed,
+             "seed for sampling and random scene values");
+  parser.add("--prepass", &settings.prepass,
+             "partition the image by the cost of a low resolution pre-pass");
+  parser.add("--prepass-scale", &settings.prepass_scale,
+             "pixels per pre-pass sample along each axis");
+  parser.add("--tiles", &settings.tiles, "number of tiles to render");
+  parser.add("--affinity", &settings.affinity,
+             "pin threads to cpus: none, compact or scatter");
+  parser.add("--replicate", &settings.replicate,
+             "give every NUMA node its own copy of the scene");
+  parser.add("--first-touch", &settings.first_touch,
+             "initialize each tile's pixels on the thread rendering it");
+  parser.add("--scaling", &settings.scaling,
+             "report render time for increasing thread counts");
+  parser.add("--isa", &settings.isa,
+             "instruction set of the evaluation kernels: auto, baseline, "
+             "sse4.2, avx2 or avx512");
+  parser.add("--fast-math", &settings.fast_math,
+             "evaluate trigonometric functions with approximations");
+  parser.add("--tolerance", &check_tolerance,
+             "largest distance error `trm check` accepts, --min by default");
+  parser.add("--samples", &check_samples,
+             "points `trm check` samples around every node");
+  parser.add("--farm", &settings.farm_workers,
+             "render with N worker processes");
+  parser.add("--farm-tiles", &settings.farm_tiles,
+             "number of tiles to split a farm render into");
+  parser.add("--farm-retries", &settings.farm_retries,
+             "attempts allowed per tile before a farm render fails");
+  parser.add("--farm-timeout", &settings.farm_timeout,
+             "seconds without a heartbeat before a worker's tile is requeued");
+  parser.add("--spool", &settings.spool_dir,
+             "shared spool directory for farm jobs");
+  parser.add("--worker", &settings.worker_spool,
+             "render jobs from a farm spool directory");
+  parser.add("SceneJSON", &scene_args,
+             "scene specification jsons, globs or @files listing them");
 
   parser.parse(argc, argv);
 
   if (show_help) {
     parser.help();
     return 0;
-  } else if (json_file == "") {
+  } else if (scene_args.size() == 0 && settings.worker_spool == "") {
     parser.help();
     std::fprintf(stderr, "ERROR: SceneJson file is required\n");
     return 1;
   }
-  PROF_END();
-  PROF_BEGIN("loadScene", "main");
-  if (!trm::load_json(json_file, &settings, &scene)) {
-    parser.help();
+  if (settings.stream_rows != 0 && settings.farm_workers != 0) {
+    std::fprintf(stderr, "ERROR: --stream can not be combined with --farm\n");
     return 1;
   }
-
-  PROF_END();
-  PROF_BEGIN("defaultArg", "main");
-  if (scene.camera.fov == 0) {
-    scene.camera.fov = M_PI / 2.0f;
+  if (settings.stream_rows != 0 &&
+      (settings.prepass || settings.tiles != 0 || settings.first_touch ||
+       settings.checkpoint_interval != 0 || settings.resume)) {
+    std::fprintf(stderr, "ERROR: --stream can not be combined with --prepass, "
+                         "--tiles, --first-touch, --checkpoint or --resume\n");
+    return 1;
   }
-  if (settings.resolution.x == 0 || settings.resolution.y == 0) {
-    settings.resolution = uvec2(500);
+  trm::numa::Affinity affinity;
+  if (!trm::numa::parse_affinity(settings.affinity, &affinity)) {
+    std::fprintf(stderr, "ERROR: Unknown affinity \"%s\"\n",
+                 settings.affinity.c_str());
+    return 1;
   }
-  if (settings.maximum_depth == 0) {
-    settings.maximum_depth = 16;
+  trm::kernel::Isa isa;
+  if (!trm::kernel::parse_isa(settings.isa, &isa)) {
+    std::fprintf(stderr, "ERROR: Unknown instruction set \"%s\"\n",
+                 settings.isa.c_str());
+    return 1;
+  } else if (!trm::kernel::select(isa)) {
+    std::fprintf(stderr, "ERROR: This CPU does not support %s, only %s\n",
+                 trm::kernel::name(isa),
+                 trm::kernel::name(trm::kernel::detect()));
+    return 1;
   }
-  if (settings.spp == 0) {
-    settings.spp = 32;
+  trm::kernel::set_fast_math(settings.fast_math);
+  topology = trm::numa::topology();
+  PROF_END();
+
+  if (settings.worker_spool != "") {
+    PROF_BEGIN("loadScene", "main");
+    if (!trm::farm::read_manifest(settings.worker_spool, &settings, &scene)) {
+      return 1;
+    }
+    if (scene.source == "" && scene_args.empty()) {
+      std::fprintf(stderr, "ERROR: The farm manifest names no scene and none "
+                           "was given\n");
+      return 1;
+    }
+    std::string file = scene.source != "" ? scene.source : scene_args[0];
+    if (!trm::load_scene(file, &settings, &scene)) {
+      return 1;
+    }
+    // The scene file may override the manifest, so it is applied again.
+    trm::farm::read_manifest(settings.worker_spool, &settings, &scene);
+    PROF_END();
+    return trm::farm::work(settings.worker_spool, render_tile) ? 0 : 1;
   }
-  if (settings.output_fmt == "") {
-    settings.output_fmt = "out/{source}.png";
+
+  std::vector<std::string> files = expand_scenes(scene_args);
+  if (files.size() == 0) {
+    std::fprintf(stderr, "ERROR: No scene matched the given patterns\n");
+    return 1;
+  } else if (pack) {
+    return pack_scenes(files, settings.seed, settings.sax_loader) ? 0 : 1;
+  } else if (check) {
+    bool ok = true;
+    for (auto &file : files) {
+      Job job = load_job(file, settings, scene.camera);
+      if (!job.ok)
+        return 1;
+      Float tolerance = check_tolerance > 0.0f
+                            ? check_tolerance
+                            : job.settings.epsilon_distance;
+      ok = trm::check::fast_math(&job.scene, tolerance, check_samples) && ok;
+    }
+    return ok ? 0 : 1;
   }
-  PROF_END();
 
-  PROF_BEGIN("scene", "main");
-  std::printf("Scene JSON:     \"%s\"\n", json_file.c_str());
-#ifdef _OPENMP
-  std::printf("OpenMP Threads: %i\n", omp_get_max_threads());
-#else
-  std::printf("OpenMP:         DISABLED\n");
-#endif
-  std::printf("Settings:\n");
-  std::printf("  Resolution:    %ux%u\n", settings.resolution.x,
-              settings.resolution.y);
-  std::printf("  SPP:           %lu\n", settings.spp);
-  std::printf("  Depth:         %lu\n", settings.maximum_depth);
-  std::printf("  Output Format: \"%s\"\n", settings.output_fmt.c_str());
-  std::printf("Scene:\n");
-  std::printf("  Camera:\n");
-  std::printf("    FOV:      %f\n", scene.camera.fov);
-  std::printf("    Position: %f, %f, %f\n", scene.camera.pos.x,
-              scene.camera.pos.y, scene.camera.pos.z);
-  std::printf("    Center:   %f, %f, %f\n", scene.camera.center.x,
-              scene.camera.center.y, scene.camera.center.z);
-  std::printf("    Up :      %f, %f, %f\n", scene.camera.up.x,
-              scene.camera.up.y, scene.camera.up.z);
-  std::printf("  Objects:   %lu\n", scene.objects.size());
-  std::printf("  Materials: %lu\n", scene.materials.size());
-  render(fmt::format(
-      settings.output_fmt,
-      fmt::arg("spp", settings.spp),
-      fmt::arg("res", fmt::format("{}-{}", settings.resolution.x, settings.resolution.y)),
-      fmt::arg("source", json_file.substr(json_file.rfind('/') + 1,
-                                          json_file.rfind('.') -
-                                              json_file.rfind('/') - 1))));
-  // render("out/" +
-  //        json_file.substr(json_file.rfind('/') + 1,
-  //                         json_file.rfind('.') - json_file.rfind('/') - 1) +
-  //        ".png");
-  PROF_END();
+  // A first SIGINT or SIGTERM stops the render at the next pixel and writes
+  // a checkpoint and a preview, a second one kills the process as usual.
+  if (settings.farm_workers == 0) {
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int signo) { interrupted = signo; };
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+  }
+
+  // Scene N + 1 is parsed on a loader thread while scene N renders, and the
+  // image of scene N - 1 is written by the image writer meanwhile.
+  const trm::RenderSettings cli_settings = settings;
+  const trm::Camera cli_camera = scene.camera;
+  const std::vector<std::string> args(argv, argv + argc);
+  auto start = std::chrono::steady_clock::now();
+  std::future<Job> next = std::async(std::launch::async, load_job, files[0],
+                                     cli_settings, cli_camera);
+  std::size_t failed = 0;
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    Job job = next.get();
+    if (i + 1 < files.size()) {
+      next = std::async(std::launch::async, load_job, files[i + 1],
+                        cli_settings, cli_camera);
+    }
+    if (!job.ok) {
+      if (files.size() == 1)
+        parser.help();
+      failed++;
+      continue;
+    }
+    std::string output = output_path(job);
+    trm::CheckpointKey stored;
+    if (settings.resume && cli_settings.seed == 0 &&
+        trm::read_checkpoint(output + ".ckpt", &stored) &&
+        stored.source == job.scene.source &&
+        stored.seed != job.settings.seed) {
+      // Random scene values depend on the seed, so the scene is loaded again
+      // with the seed the checkpoint was rendered with.
+      trm::RenderSettings seeded = cli_settings;
+      seeded.seed = stored.seed;
+      job = load_job(files[i], seeded, cli_camera);
+    }
+    settings = job.settings;
+    scene = std::move(job.scene);
+
+    PROF_BEGIN("scene", "main");
+    print_scene(affinity);
+    if (affinity != trm::numa::NONE || settings.replicate) {
+      setup_threads();
+    }
+    if (settings.scaling) {
+      scaling_report(output, args);
+    } else {
+      render(output, args);
+    }
+    PROF_END();
+    if (interrupted)
+      break;
+  }
+  writer.flush();
+  if (files.size() > 1) {
+    std::printf("Rendered %lu of %lu scenes in %s\n", files.size() - failed,
+                files.size(),
+                ProgressBar::format_interval(
+                    std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count())
+                    .c_str());
+  }
 
-  return 0;
+  if (interrupted)
+    return 128 + interrupted;
+  return failed == 0 ? 0 : 1;
 }
@@ -9,10 +9,16 @@ struct Material {
   enum Shading { EMIS, DIFF, SPEC, REFR };
   Material(const Shading &type, const Vec3 &color, const Float &emission,
            const Float &ior)
-      : type(type), color(color), emission(emission), ior(ior) {}
+      : type(type), color(color), emission(emission), ior(ior), trap(false),
+        trap_color(color) {}
   Shading type;
   Vec3 color;
   Float emission, ior;
+  // With `trap`, fractals are colored by their orbit traps, from
+  // `trap_color` where orbits pass through the origin to `color` where they
+  // stay a unit or more away from it.
+  bool trap;
+  Vec3 trap_color;
 };
 inline std::shared_ptr<Material> matEmis(const Float &emission,
                                          const Vec3 &color = Vec3(1.0)) {
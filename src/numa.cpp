@@ -0,0 +1,149 @@
+#include "numa.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sched.h>
+
+namespace {
+cpu_set_t allowed_cpus() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  return allowed;
+}
+// Read before main, so before any thread is pinned.
+const cpu_set_t process_cpus = allowed_cpus();
+
+std::vector<int> parse_cpulist(const std::string &str) {
+  std::vector<int> cpus;
+  std::size_t pos = 0;
+  while (pos < str.size()) {
+    int lo, hi, len = 0;
+    if (std::sscanf(str.c_str() + pos, "%d-%d%n", &lo, &hi, &len) == 2) {
+    } else if (std::sscanf(str.c_str() + pos, "%d%n", &lo, &len) == 1) {
+      hi = lo;
+    } else {
+      break;
+    }
+    for (int cpu = lo; cpu <= hi; ++cpu)
+      cpus.push_back(cpu);
+    pos += len;
+    if (pos < str.size() && str[pos] == ',')
+      pos++;
+    else
+      break;
+  }
+  return cpus;
+}
+} // namespace
+
+int trm::numa::Topology::node_of(int cpu) const {
+  for (std::size_t n = 0; n < nodes.size(); ++n) {
+    for (auto &c : nodes[n]) {
+      if (c == cpu)
+        return static_cast<int>(n);
+    }
+  }
+  return 0;
+}
+std::size_t trm::numa::Topology::cpus() const {
+  std::size_t count = 0;
+  for (auto &node : nodes)
+    count += node.size();
+  return count;
+}
+
+trm::numa::Topology trm::numa::topology() {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  Topology topo;
+  for (int n = 0;; ++n) {
+    char path[64];
+    std::snprintf(path, sizeof(path),
+                  "/sys/devices/system/node/node%d/cpulist", n);
+    FILE *in = std::fopen(path, "r");
+    if (in == nullptr)
+      break;
+    char buf[1024] = {0};
+    if (std::fgets(buf, sizeof(buf), in) == nullptr)
+      buf[0] = '\0';
+    std::fclose(in);
+    std::vector<int> cpus;
+    for (auto &cpu : parse_cpulist(buf)) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+    if (cpus.size() != 0)
+      topo.nodes.push_back(cpus);
+  }
+  if (topo.nodes.size() == 0) {
+    topo.nodes.push_back({});
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed))
+        topo.nodes.back().push_back(cpu);
+    }
+  }
+  return topo;
+}
+
+bool trm::numa::parse_affinity(const std::string &str, Affinity *affinity) {
+  if (str == "" || str == "none") {
+    *affinity = NONE;
+  } else if (str == "compact") {
+    *affinity = COMPACT;
+  } else if (str == "scatter") {
+    *affinity = SCATTER;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int trm::numa::cpu_for(const Topology &topo, const Affinity &affinity,
+                       int thread) {
+  std::size_t cpus = topo.cpus();
+  if (affinity == NONE || cpus == 0)
+    return -1;
+  std::size_t t = static_cast<std::size_t>(thread) % cpus;
+  if (affinity == COMPACT) {
+    for (auto &node : topo.nodes) {
+      if (t < node.size())
+        return node[t];
+      t -= node.size();
+    }
+  } else {
+    // Round robin across nodes, skipping nodes that have run out of CPUs.
+    std::vector<std::size_t> used(topo.nodes.size(), 0);
+    std::size_t n = 0;
+    while (true) {
+      if (used[n] < topo.nodes[n].size()) {
+        if (t == 0)
+          return topo.nodes[n][used[n]];
+        used[n]++;
+        t--;
+      }
+      n = (n + 1) % topo.nodes.size();
+    }
+  }
+  return -1;
+}
+
+bool trm::numa::pin(int cpu) {
+  if (cpu < 0)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool trm::numa::unpin() {
+  return sched_setaffinity(0, sizeof(process_cpus), &process_cpus) == 0;
+}
+
+int trm::numa::current_cpu() { return sched_getcpu(); }
@@ -0,0 +1,32 @@
+#ifndef TRM_NUMA_HPP_
+#define TRM_NUMA_HPP_
+
+#include <string>
+#include <vector>
+
+namespace trm {
+namespace numa {
+  enum Affinity { NONE, COMPACT, SCATTER };
+
+  // CPUs of every NUMA node that the process may run on, read from sysfs.
+  // Machines without NUMA information report a single node.
+  struct Topology {
+    std::vector<std::vector<int>> nodes;
+    int node_of(int cpu) const;
+    std::size_t cpus() const;
+  };
+
+  Topology topology();
+  bool parse_affinity(const std::string &str, Affinity *affinity);
+  // CPU for thread `thread`: COMPACT fills one node before the next, SCATTER
+  // deals threads round robin across nodes. Returns -1 for NONE.
+  int cpu_for(const Topology &topo, const Affinity &affinity, int thread);
+  bool pin(int cpu);
+  // Lets the calling thread run on every CPU the process started with again.
+  bool unpin();
+  // CPU the calling thread is running on.
+  int current_cpu();
+} // namespace numa
+} // namespace trm
+
+#endif // TRM_NUMA_HPP_
@@ -0,0 +1,255 @@
+#include "opt.hpp"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "prof.hpp"
+#include "sdf.hpp"
+#include "type.hpp"
+
+namespace {
+typedef std::map<const trm::Sdf *, std::shared_ptr<trm::Sdf>> Done;
+
+void collect(trm::Sdf *node, std::set<const trm::Sdf *> *seen) {
+  if (node == nullptr || !seen->insert(node).second)
+    return;
+  for (auto &child : trm::child_slots(node))
+    collect(child->get(), seen);
+}
+
+// `node` carrying the transform and material of `from`, which must not have a
+// transform of its own.
+std::shared_ptr<trm::Sdf> replace(const std::shared_ptr<trm::Sdf> &from,
+                                  const std::shared_ptr<trm::Sdf> &node) {
+  if (from->mat == nullptr || from->mat == node->mat)
+    return node;
+  std::shared_ptr<trm::Sdf> copy = node->clone();
+  copy->mat = from->mat;
+  return copy;
+}
+
+// Same as `replace`, for a new node that takes over the transform of `from`.
+std::shared_ptr<trm::Sdf> take_over(const std::shared_ptr<trm::Sdf> &from,
+                                    const std::shared_ptr<trm::Sdf> &node) {
+  node->trans = from->trans;
+  node->inv = from->inv;
+  node->transformed = from->transformed;
+  node->mat = from->mat;
+  return node;
+}
+
+// Operands of a union chain without transforms of their own.
+void operands(const std::shared_ptr<trm::Sdf> &node,
+              std::vector<std::shared_ptr<trm::Sdf>> *out) {
+  using trm::SdfKind;
+  if (!node->transformed && node->kind() == SdfKind::Union) {
+    operands(node->a, out);
+    operands(node->b, out);
+  } else if (!node->transformed && node->kind() == SdfKind::MultiUnion) {
+    for (auto &child : static_cast<const trm::MultiUnion &>(*node).nodes)
+      out->push_back(child);
+  } else {
+    out->push_back(node);
+  }
+}
+
+std::shared_ptr<trm::Sdf> simplify(const std::shared_ptr<trm::Sdf> &node,
+                                   Done *done) {
+  using trm::SdfKind;
+  auto it = done->find(node.get());
+  if (it != done->end())
+    return it->second;
+  for (auto &child : trm::child_slots(node.get()))
+    *child = simplify(*child, done);
+  if (node->inv == Mat4(1.0f) && node->trans == Mat4(1.0f))
+    node->transformed = false;
+
+  std::shared_ptr<trm::Sdf> result = node;
+  switch (node->kind()) {
+  case SdfKind::Round: {
+    const trm::Round &round = static_cast<const trm::Round &>(*node);
+    if (round.radius == 0.0f && !node->transformed) {
+      result = replace(node, node->a);
+    } else if (node->a->kind() == SdfKind::Round && !node->a->transformed) {
+      Float inner = static_cast<const trm::Round &>(*node->a).radius;
+      result = take_over(
+          node, trm::sdfRound(node->a->a, Float(inner + round.radius)));
+    }
+  } break;
+  case SdfKind::Elongate:
+    if (static_cast<const trm::Elongate &>(*node).h == Vec3(0.0f))
+      result = take_over(node, trm::sdfMirror(node->a, Vec3(1.0f)));
+    break;
+  case SdfKind::Repeat:
+    if (static_cast<const trm::Repeat &>(*node).period == Vec3(0.0f) &&
+        !node->transformed)
+      result = replace(node, node->a);
+    break;
+  case SdfKind::Mirror:
+    if (static_cast<const trm::Mirror &>(*node).axes == Vec3(0.0f) &&
+        !node->transformed)
+      result = replace(node, node->a);
+    break;
+  case SdfKind::PolarRepeat:
+    if (static_cast<const trm::PolarRepeat &>(*node).count == 1 &&
+        !node->transformed)
+      result = replace(node, node->a);
+    break;
+  case SdfKind::Instance:
+    if (!node->transformed)
+      result = replace(node, node->a);
+    break;
+  case SdfKind::Union: {
+    std::vector<std::shared_ptr<trm::Sdf>> nodes;
+    operands(node->a, &nodes);
+    operands(node->b, &nodes);
+    if (nodes.size() > 2)
+      result = take_over(node, trm::sdfMultiUnion(nodes));
+  } break;
+  case SdfKind::SmoothUnion:
+    if (static_cast<const trm::SmoothUnion &>(*node).radius == 0.0f)
+      result = take_over(node, trm::sdfUnion(node->a, node->b));
+    break;
+  case SdfKind::SmoothSubtraction:
+    if (static_cast<const trm::SmoothSubtraction &>(*node).radius == 0.0f)
+      result = take_over(node, trm::sdfSubtraction(node->a, node->b));
+    break;
+  case SdfKind::SmoothIntersection:
+    if (static_cast<const trm::SmoothIntersection &>(*node).radius == 0.0f)
+      result = take_over(node, trm::sdfIntersection(node->a, node->b));
+    break;
+  default:
+    break;
+  }
+  if (result != node)
+    result = simplify(result, done);
+  (*done)[node.get()] = result;
+  return result;
+}
+} // namespace
+
+float trm::opt::cost(const Sdf &node) {
+  float own = 0.0f;
+  switch (node.kind()) {
+  case SdfKind::Sphere:
+  case SdfKind::Plane:
+    own = 6.0f;
+    break;
+  case SdfKind::Box:
+  case SdfKind::Torus:
+    own = 14.0f;
+    break;
+  case SdfKind::Cylinder:
+    own = 16.0f;
+    break;
+  case SdfKind::Pyramid:
+    own = 50.0f;
+    break;
+  case SdfKind::MengerSponge:
+    own = 14.0f + 24.0f * static_cast<const MengerSponge &>(node).iterations;
+    break;
+  case SdfKind::SerpinskiTetrahedron:
+    own = 10.0f +
+          15.0f * static_cast<const SerpinskiTetrahedron &>(node).iterations;
+    break;
+  case SdfKind::Kifs: {
+    const Kifs &k = static_cast<const Kifs &>(node);
+    own = 10.0f + ((k.symmetry == Kifs::TETRAHEDRAL ? 15.0f : 12.0f) +
+                   (k.rotated ? 15.0f : 0.0f)) *
+                      k.iterations;
+  } break;
+  case SdfKind::Mandelbulb:
+    own = 10.0f + 120.0f * static_cast<const Mandelbulb &>(node).iterations;
+    break;
+  case SdfKind::Mandelbox:
+    own = 8.0f + 30.0f * static_cast<const Mandelbox &>(node).iterations;
+    break;
+  case SdfKind::Elongate:
+  case SdfKind::Repeat:
+    own = 10.0f;
+    break;
+  case SdfKind::LimitedRepeat:
+    own = 16.0f;
+    break;
+  case SdfKind::Mirror:
+    own = 6.0f;
+    break;
+  case SdfKind::PolarRepeat:
+    own = 60.0f;
+    break;
+  case SdfKind::Round:
+  case SdfKind::Union:
+  case SdfKind::Instance:
+    own = 1.0f;
+    break;
+  case SdfKind::Onion:
+  case SdfKind::Subtraction:
+  case SdfKind::Intersection:
+    own = 2.0f;
+    break;
+  case SdfKind::MultiUnion:
+    own = static_cast<const MultiUnion &>(node).nodes.size() - 1.0f;
+    break;
+  case SdfKind::SmoothUnion:
+  case SdfKind::SmoothSubtraction:
+  case SdfKind::SmoothIntersection:
+    own = 10.0f;
+    break;
+  }
+  // A virtual call, plus the 3x4 matrix product of the transform.
+  return own + 2.0f + (node.transformed ? 21.0f : 0.0f);
+}
+
+trm::opt::Stats trm::opt::measure(const Scene &scene) {
+  std::set<const Sdf *> seen, evaluated;
+  std::set<const Material *> materials;
+  for (auto &obj : scene.objects) {
+    collect(obj.get(), &seen);
+    if (obj->mat != nullptr)
+      collect(obj.get(), &evaluated);
+  }
+  for (auto &mat : scene.materials)
+    materials.insert(mat.get());
+  Stats stats{seen.size(), materials.size(), 0.0f};
+  for (auto &node : evaluated)
+    stats.cost += cost(*node);
+  // `sdfScene` visits every object, rendered or not.
+  stats.cost += 2.0f * scene.objects.size();
+  return stats;
+}
+
+void trm::opt::optimize(Scene *scene) {
+  PROF_FUNC("opt", "objects", scene->objects.size());
+  // Only the materials of rendered objects are ever read.
+  std::set<const Sdf *> rendered, children;
+  for (auto &obj : scene->objects) {
+    if (obj->mat != nullptr) {
+      rendered.insert(obj.get());
+      for (auto &child : child_slots(obj.get()))
+        collect(child->get(), &children);
+    }
+  }
+  for (auto &child : children) {
+    if (rendered.count(child) == 0)
+      const_cast<Sdf *>(child)->mat = nullptr;
+  }
+
+  Done done;
+  std::vector<std::shared_ptr<Sdf>> objects;
+  std::set<const Material *> used;
+  for (auto &obj : scene->objects) {
+    if (obj->mat == nullptr)
+      continue;
+    objects.push_back(simplify(obj, &done));
+    used.insert(objects.back()->mat.get());
+  }
+  scene->objects = objects;
+  std::vector<std::shared_ptr<Material>> materials;
+  for (auto &mat : scene->materials) {
+    if (used.count(mat.get()) != 0)
+      materials.push_back(mat);
+  }
+  scene->materials = materials;
+}
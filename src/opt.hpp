@@ -0,0 +1,35 @@
+#ifndef TRM_OPT_HPP_
+#define TRM_OPT_HPP_
+
+#include <cstddef>
+
+#include "scene.hpp"
+#include "sdf.hpp"
+
+namespace trm {
+namespace opt {
+  struct Stats {
+    std::size_t nodes, materials;
+    float cost;
+  };
+
+  // Distinct nodes and materials reachable from the scene objects, and the
+  // estimated cost of one `sdfScene` query, counting every node once as
+  // memoization evaluates shared nodes once per point. Costs are rough
+  // floating point operation counts.
+  Stats measure(const Scene &scene);
+  float cost(const Sdf &node);
+
+  // Rewrites the scene graph into a cheaper one with the same distances:
+  // - chains of unions become n-ary `MultiUnion`s,
+  // - nested `Round`s are summed, and `Round`s, `Instance`s and domain
+  //   operators that do nothing are replaced by their child,
+  // - `Elongate` by zero becomes a `Mirror` on every axis,
+  // - smooth operators with a radius of 0 become their sharp versions,
+  // - nodes whose transform is the identity skip the matrix product,
+  // - objects and materials that no rendered object uses are dropped.
+  void optimize(Scene *scene);
+} // namespace opt
+} // namespace trm
+
+#endif // TRM_OPT_HPP_
@@ -0,0 +1,459 @@
+#include "pack.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prof.hpp"
+#include "sdf.hpp"
+
+#define PACK_MAGIC 0x534d5254u // "TRMS"
+#define PACK_VERSION 3u
+
+namespace {
+// Settings the scene file gave, which are applied on load.
+const uint32_t MAXIMUM_DISTANCE = 1 << 0;
+const uint32_t EPSILON_DISTANCE = 1 << 1;
+const uint32_t RESOLUTION = 1 << 2;
+const uint32_t MAXIMUM_DEPTH = 1 << 3;
+const uint32_t SPP = 1 << 4;
+const uint32_t NO_BAR = 1 << 5;
+const uint32_t SEED = 1 << 6;
+const uint32_t OUTPUT = 1 << 7;
+
+struct PackedHeader {
+  uint32_t magic, version;
+  uint32_t material_count, node_count, object_count, output_size;
+  uint32_t flags;
+  float maximum_distance, epsilon_distance;
+  uint32_t resolution[2];
+  uint32_t maximum_depth, spp;
+  uint64_t seed;
+  float fov, pos[3], center[3], up[3];
+};
+struct PackedMaterial {
+  uint32_t shading;
+  float color[3];
+  float emission, ior;
+  uint32_t trap;
+  float trap_color[3];
+};
+// Children and materials are indices, -1 for none. `params` holds the
+// node's own values in declaration order.
+struct PackedNode {
+  uint32_t kind;
+  int32_t material, a, b;
+  float trans[16], inv[16];
+  float params[8];
+  // Iteration or repetition count, and the variant of nodes that have one.
+  uint32_t iterations, variant;
+};
+
+PackedMaterial pack_material(const trm::Material &mat) {
+  return {static_cast<uint32_t>(mat.type),
+          {mat.color.r, mat.color.g, mat.color.b},
+          mat.emission,
+          mat.ior,
+          mat.trap ? 1u : 0u,
+          {mat.trap_color.r, mat.trap_color.g, mat.trap_color.b}};
+}
+
+void pack_params(const trm::Sdf &node, PackedNode *out) {
+  using trm::SdfKind;
+  float *p = out->params;
+  switch (node.kind()) {
+  case SdfKind::Sphere:
+    p[0] = static_cast<const trm::Sphere &>(node).radius;
+    break;
+  case SdfKind::Box: {
+    const Vec3 &dim = static_cast<const trm::Box &>(node).dim;
+    p[0] = dim.x, p[1] = dim.y, p[2] = dim.z;
+  } break;
+  case SdfKind::Cylinder: {
+    const trm::Cylinder &c = static_cast<const trm::Cylinder &>(node);
+    p[0] = c.height, p[1] = c.radius;
+  } break;
+  case SdfKind::Torus: {
+    const Vec2 &t = static_cast<const trm::Torus &>(node).torus;
+    p[0] = t.x, p[1] = t.y;
+  } break;
+  case SdfKind::Plane: {
+    const Vec4 &n = static_cast<const trm::Plane &>(node).norm;
+    p[0] = n.x, p[1] = n.y, p[2] = n.z, p[3] = n.w;
+  } break;
+  case SdfKind::Pyramid:
+    p[0] = static_cast<const trm::Pyramid &>(node).height;
+    break;
+  case SdfKind::MengerSponge:
+    out->iterations = static_cast<const trm::MengerSponge &>(node).iterations;
+    break;
+  case SdfKind::SerpinskiTetrahedron:
+    out->iterations =
+        static_cast<const trm::SerpinskiTetrahedron &>(node).iterations;
+    break;
+  case SdfKind::Kifs: {
+    const trm::Kifs &k = static_cast<const trm::Kifs &>(node);
+    out->iterations = k.iterations;
+    out->variant = k.symmetry;
+    p[0] = k.factor;
+    p[1] = k.offset.x, p[2] = k.offset.y, p[3] = k.offset.z;
+    p[4] = k.angles.x, p[5] = k.angles.y, p[6] = k.angles.z;
+  } break;
+  case SdfKind::Mandelbulb: {
+    const trm::Mandelbulb &m = static_cast<const trm::Mandelbulb &>(node);
+    out->iterations = m.iterations;
+    p[0] = m.power;
+  } break;
+  case SdfKind::Mandelbox: {
+    const trm::Mandelbox &m = static_cast<const trm::Mandelbox &>(node);
+    out->iterations = m.iterations;
+    p[0] = m.factor, p[1] = m.min_radius, p[2] = m.fixed_radius;
+    p[3] = m.limit;
+  } break;
+  case SdfKind::Elongate: {
+    const Vec3 &h = static_cast<const trm::Elongate &>(node).h;
+    p[0] = h.x, p[1] = h.y, p[2] = h.z;
+  } break;
+  case SdfKind::Round:
+    p[0] = static_cast<const trm::Round &>(node).radius;
+    break;
+  case SdfKind::Onion:
+    p[0] = static_cast<const trm::Onion &>(node).thickness;
+    break;
+  case SdfKind::SmoothUnion:
+    p[0] = static_cast<const trm::SmoothUnion &>(node).radius;
+    break;
+  case SdfKind::SmoothSubtraction:
+    p[0] = static_cast<const trm::SmoothSubtraction &>(node).radius;
+    break;
+  case SdfKind::SmoothIntersection:
+    p[0] = static_cast<const trm::SmoothIntersection &>(node).radius;
+    break;
+  case SdfKind::Repeat: {
+    const Vec3 &period = static_cast<const trm::Repeat &>(node).period;
+    p[0] = period.x, p[1] = period.y, p[2] = period.z;
+  } break;
+  case SdfKind::LimitedRepeat: {
+    const trm::LimitedRepeat &r = static_cast<const trm::LimitedRepeat &>(node);
+    p[0] = r.period.x, p[1] = r.period.y, p[2] = r.period.z;
+    p[3] = r.limit.x, p[4] = r.limit.y, p[5] = r.limit.z;
+  } break;
+  case SdfKind::Mirror: {
+    const Vec3 &axes = static_cast<const trm::Mirror &>(node).axes;
+    p[0] = axes.x, p[1] = axes.y, p[2] = axes.z;
+  } break;
+  case SdfKind::PolarRepeat:
+    out->iterations = static_cast<const trm::PolarRepeat &>(node).count;
+    break;
+  case SdfKind::Union:
+  case SdfKind::Subtraction:
+  case SdfKind::Intersection:
+  case SdfKind::Instance:
+  case SdfKind::MultiUnion:
+    break;
+  }
+}
+
+std::shared_ptr<trm::Sdf> unpack_node(const PackedNode &node) {
+  using trm::SdfKind;
+  const float *p = node.params;
+  switch (static_cast<SdfKind>(node.kind)) {
+  case SdfKind::Sphere:
+    return trm::sdfSphere(p[0]);
+  case SdfKind::Box:
+    return trm::sdfBox(p[0], p[1], p[2]);
+  case SdfKind::Cylinder:
+    return trm::sdfCylinder(p[0], p[1]);
+  case SdfKind::Torus:
+    return trm::sdfTorus(p[0], p[1]);
+  case SdfKind::Plane: {
+    std::shared_ptr<trm::Sdf> plane = trm::sdfPlane(p[0], p[1], p[2], p[3]);
+    // Stored already normalized, so it is restored bit for bit.
+    std::static_pointer_cast<trm::Plane>(plane)->norm =
+        Vec4(p[0], p[1], p[2], p[3]);
+    return plane;
+  }
+  case SdfKind::Pyramid:
+    return trm::sdfPyramid(p[0]);
+  case SdfKind::MengerSponge:
+    return trm::sdfMengerSponge(std::size_t(node.iterations));
+  case SdfKind::SerpinskiTetrahedron:
+    return trm::sdfSerpinskiTetrahedron(std::size_t(node.iterations));
+  case SdfKind::Kifs:
+    return trm::sdfKifs(std::size_t(node.iterations),
+                        static_cast<trm::Kifs::Symmetry>(node.variant),
+                        Float(p[0]), Vec3(p[1], p[2], p[3]),
+                        Vec3(p[4], p[5], p[6]));
+  case SdfKind::Mandelbulb:
+    return trm::sdfMandelbulb(std::size_t(node.iterations), Float(p[0]));
+  case SdfKind::Mandelbox:
+    return trm::sdfMandelbox(std::size_t(node.iterations), Float(p[0]),
+                             Float(p[1]), Float(p[2]), Float(p[3]));
+  case SdfKind::Elongate:
+    return trm::sdfElongate(nullptr, Vec3(p[0], p[1], p[2]));
+  case SdfKind::Round:
+    return trm::sdfRound(nullptr, Float(p[0]));
+  case SdfKind::Onion:
+    return trm::sdfOnion(nullptr, Float(p[0]));
+  case SdfKind::Repeat:
+    return trm::sdfRepeat(nullptr, Vec3(p[0], p[1], p[2]));
+  case SdfKind::LimitedRepeat:
+    return trm::sdfLimitedRepeat(nullptr, Vec3(p[0], p[1], p[2]),
+                                 Vec3(p[3], p[4], p[5]));
+  case SdfKind::Mirror:
+    return trm::sdfMirror(nullptr, Vec3(p[0], p[1], p[2]));
+  case SdfKind::PolarRepeat:
+    return trm::sdfPolarRepeat(nullptr, std::size_t(node.iterations));
+  case SdfKind::Instance:
+    return trm::sdfInstance(nullptr);
+  case SdfKind::MultiUnion:
+    // Only built by the optimizer, which runs after packing.
+    return nullptr;
+  case SdfKind::Union:
+    return trm::sdfUnion(nullptr, nullptr);
+  case SdfKind::Subtraction:
+    return trm::sdfSubtraction(nullptr, nullptr);
+  case SdfKind::Intersection:
+    return trm::sdfIntersection(nullptr, nullptr);
+  case SdfKind::SmoothUnion:
+    return trm::sdfSmoothUnion(nullptr, nullptr, Float(p[0]));
+  case SdfKind::SmoothSubtraction:
+    return trm::sdfSmoothSubtraction(nullptr, nullptr, Float(p[0]));
+  case SdfKind::SmoothIntersection:
+    return trm::sdfSmoothIntersection(nullptr, nullptr, Float(p[0]));
+  }
+  return nullptr;
+}
+
+void index_nodes(const std::shared_ptr<trm::Sdf> &node,
+                 std::map<const trm::Sdf *, int32_t> *index,
+                 std::vector<const trm::Sdf *> *nodes) {
+  if (node == nullptr || index->count(node.get()) != 0)
+    return;
+  (*index)[node.get()] = static_cast<int32_t>(nodes->size());
+  nodes->push_back(node.get());
+  index_nodes(node->a, index, nodes);
+  index_nodes(node->b, index, nodes);
+}
+} // namespace
+
+bool trm::pack_scene(const std::string &file, const RenderSettings &settings,
+                     const Scene &scene) {
+  PROF_FUNC("pack", "file", file);
+  const RenderSettings defaults;
+  PackedHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PACK_MAGIC;
+  header.version = PACK_VERSION;
+  header.flags =
+      (settings.maximum_distance != defaults.maximum_distance
+           ? MAXIMUM_DISTANCE
+           : 0) |
+      (settings.epsilon_distance != defaults.epsilon_distance
+           ? EPSILON_DISTANCE
+           : 0) |
+      (settings.resolution != defaults.resolution ? RESOLUTION : 0) |
+      (settings.maximum_depth != defaults.maximum_depth ? MAXIMUM_DEPTH : 0) |
+      (settings.spp != defaults.spp ? SPP : 0) |
+      (settings.no_bar != defaults.no_bar ? NO_BAR : 0) | SEED |
+      (settings.output_fmt != defaults.output_fmt ? OUTPUT : 0);
+  header.maximum_distance = settings.maximum_distance;
+  header.epsilon_distance = settings.epsilon_distance;
+  header.resolution[0] = settings.resolution.x;
+  header.resolution[1] = settings.resolution.y;
+  header.maximum_depth = settings.maximum_depth;
+  header.spp = settings.spp;
+  header.seed = settings.seed;
+  header.output_size = settings.output_fmt.size();
+  header.fov = scene.camera.fov;
+  for (int i = 0; i < 3; ++i) {
+    header.pos[i] = scene.camera.pos[i];
+    header.center[i] = scene.camera.center[i];
+    header.up[i] = scene.camera.up[i];
+  }
+
+  std::map<const Material *, int32_t> material_index;
+  std::vector<PackedMaterial> materials;
+  for (auto &mat : scene.materials) {
+    material_index[mat.get()] = static_cast<int32_t>(materials.size());
+    materials.push_back(pack_material(*mat));
+  }
+  // Scene objects come first, in order, followed by any node that is only
+  // reachable as a child.
+  std::map<const Sdf *, int32_t> node_index;
+  std::vector<const Sdf *> order;
+  for (auto &obj : scene.objects) {
+    if (node_index.count(obj.get()) == 0) {
+      node_index[obj.get()] = static_cast<int32_t>(order.size());
+      order.push_back(obj.get());
+    }
+  }
+  for (auto &obj : scene.objects) {
+    index_nodes(obj->a, &node_index, &order);
+    index_nodes(obj->b, &node_index, &order);
+  }
+  std::vector<PackedNode> nodes(order.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    const Sdf &node = *order[i];
+    if (node.kind() == SdfKind::MultiUnion) {
+      std::fprintf(stderr, "Optimized scenes can not be packed\n");
+      return false;
+    }
+    PackedNode &out = nodes[i];
+    std::memset(&out, 0, sizeof(out));
+    out.kind = static_cast<uint32_t>(node.kind());
+    out.material = -1;
+    if (node.mat != nullptr) {
+      auto it = material_index.find(node.mat.get());
+      if (it == material_index.end()) {
+        out.material = static_cast<int32_t>(materials.size());
+        material_index[node.mat.get()] = out.material;
+        materials.push_back(pack_material(*node.mat));
+      } else {
+        out.material = it->second;
+      }
+    }
+    out.a = node.a != nullptr ? node_index[node.a.get()] : -1;
+    out.b = node.b != nullptr ? node_index[node.b.get()] : -1;
+    for (int c = 0; c < 4; ++c) {
+      for (int r = 0; r < 4; ++r) {
+        out.trans[4 * c + r] = node.trans[c][r];
+        out.inv[4 * c + r] = node.inv[c][r];
+      }
+    }
+    pack_params(node, &out);
+  }
+  header.material_count = materials.size();
+  header.node_count = nodes.size();
+  header.object_count = scene.objects.size();
+
+  std::string tmp = file + ".tmp";
+  FILE *out = std::fopen(tmp.c_str(), "wb");
+  if (out == nullptr) {
+    std::fprintf(stderr, "Failed to open \"%s\"\n", tmp.c_str());
+    return false;
+  }
+  bool ok =
+      std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+      std::fwrite(materials.data(), sizeof(PackedMaterial), materials.size(),
+                  out) == materials.size() &&
+      std::fwrite(nodes.data(), sizeof(PackedNode), nodes.size(), out) ==
+          nodes.size() &&
+      std::fwrite(settings.output_fmt.data(), 1, header.output_size, out) ==
+          header.output_size;
+  ok = (std::fclose(out) == 0) && ok;
+  return ok && std::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+bool trm::load_packed(const std::string &file, RenderSettings *settings,
+                      Scene *scene) {
+  PROF_FUNC("pack", "file", file);
+  int fd = open(file.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::fprintf(stderr, "Failed to load packed scene \"%s\"\n", file.c_str());
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  std::size_t size = st.st_size;
+  void *map = size != 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                        : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::fprintf(stderr, "Failed to map packed scene \"%s\"\n", file.c_str());
+    return false;
+  }
+  const uint8_t *data = static_cast<const uint8_t *>(map);
+  const PackedHeader &header = *reinterpret_cast<const PackedHeader *>(data);
+  if (size < sizeof(PackedHeader) || header.magic != PACK_MAGIC ||
+      header.version != PACK_VERSION ||
+      size != sizeof(PackedHeader) +
+                  sizeof(PackedMaterial) * std::size_t(header.material_count) +
+                  sizeof(PackedNode) * std::size_t(header.node_count) +
+                  header.output_size ||
+      header.object_count > header.node_count) {
+    std::fprintf(stderr, "\"%s\" is not a packed scene of version %u\n",
+                 file.c_str(), PACK_VERSION);
+    munmap(map, size);
+    return false;
+  }
+  const PackedMaterial *materials =
+      reinterpret_cast<const PackedMaterial *>(data + sizeof(PackedHeader));
+  const PackedNode *nodes = reinterpret_cast<const PackedNode *>(
+      materials + header.material_count);
+  const char *output = reinterpret_cast<const char *>(nodes + header.node_count);
+  scene->source = file;
+
+  if (header.flags & MAXIMUM_DISTANCE)
+    settings->maximum_distance = header.maximum_distance;
+  if (header.flags & EPSILON_DISTANCE)
+    settings->epsilon_distance = header.epsilon_distance;
+  if ((header.flags & RESOLUTION) &&
+      (settings->resolution.x == 0 || settings->resolution.y == 0))
+    settings->resolution = uvec2(header.resolution[0], header.resolution[1]);
+  if ((header.flags & MAXIMUM_DEPTH) && settings->maximum_depth == 0)
+    settings->maximum_depth = header.maximum_depth;
+  if ((header.flags & SPP) && settings->spp == 0)
+    settings->spp = header.spp;
+  if ((header.flags & NO_BAR) && settings->no_bar == false)
+    settings->no_bar = true;
+  if ((header.flags & SEED) && settings->seed == 0)
+    settings->seed = header.seed;
+  if ((header.flags & OUTPUT) && settings->output_fmt == "")
+    settings->output_fmt = std::string(output, header.output_size);
+  if (header.fov != 0.0f)
+    scene->camera.fov = header.fov;
+  scene->camera.pos = Vec3(header.pos[0], header.pos[1], header.pos[2]);
+  scene->camera.center =
+      Vec3(header.center[0], header.center[1], header.center[2]);
+  scene->camera.up = Vec3(header.up[0], header.up[1], header.up[2]);
+
+  for (uint32_t i = 0; i < header.material_count; ++i) {
+    const PackedMaterial &m = materials[i];
+    scene->materials.push_back(std::make_shared<Material>(
+        static_cast<Material::Shading>(m.shading),
+        Vec3(m.color[0], m.color[1], m.color[2]), m.emission, m.ior));
+    scene->materials.back()->trap = m.trap != 0;
+    scene->materials.back()->trap_color =
+        Vec3(m.trap_color[0], m.trap_color[1], m.trap_color[2]);
+  }
+  std::vector<std::shared_ptr<Sdf>> built(header.node_count);
+  bool ok = true;
+  for (uint32_t i = 0; i < header.node_count && ok; ++i) {
+    const PackedNode &node = nodes[i];
+    built[i] = unpack_node(node);
+    ok = built[i] != nullptr && node.material < int32_t(header.material_count) &&
+         node.a < int32_t(header.node_count) &&
+         node.b < int32_t(header.node_count);
+    if (!ok)
+      break;
+    for (int c = 0; c < 4; ++c) {
+      for (int r = 0; r < 4; ++r) {
+        built[i]->trans[c][r] = node.trans[4 * c + r];
+        built[i]->inv[c][r] = node.inv[4 * c + r];
+      }
+    }
+    if (node.material >= 0)
+      built[i]->mat = scene->materials[node.material];
+  }
+  for (uint32_t i = 0; i < header.node_count && ok; ++i) {
+    if (nodes[i].a >= 0)
+      built[i]->a = built[nodes[i].a];
+    if (nodes[i].b >= 0)
+      built[i]->b = built[nodes[i].b];
+  }
+  if (ok) {
+    scene->objects.assign(built.begin(), built.begin() + header.object_count);
+  } else {
+    std::fprintf(stderr, "Corrupt packed scene \"%s\"\n", file.c_str());
+  }
+  munmap(map, size);
+  return ok;
+}
@@ -0,0 +1,21 @@
+#ifndef TRM_PACK_HPP_
+#define TRM_PACK_HPP_
+
+#include <string>
+
+#include "scene.hpp"
+#include "settings.hpp"
+
+namespace trm {
+// Writes the loaded scene (settings given by the scene file, camera,
+// materials and every SDF node with its transform) as a versioned binary
+// file. Random values in the scene are resolved with the scene's seed.
+bool pack_scene(const std::string &file, const RenderSettings &settings,
+                const Scene &scene);
+// Maps a packed scene and builds the nodes straight from its fixed size
+// records. Settings follow the same precedence as `load_json`.
+bool load_packed(const std::string &file, RenderSettings *settings,
+                 Scene *scene);
+} // namespace trm
+
+#endif // TRM_PACK_HPP_
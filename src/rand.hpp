@@ -2,20 +2,57 @@
 #define TRM_RAND_HPP_
 
 #include "type.hpp"
+#include <cstdint>
 #include <random>
 
 namespace trm {
-static std::random_device rd;
-static std::mt19937 gen(rd());
-static std::uniform_int_distribution<int>
-    idist(0, std::numeric_limits<int>::max());
-static std::uniform_real_distribution<Float> dist(0.0f, 1.0f);
-static std::uniform_real_distribution<Float> dist2(-1.0f, 1.0f);
-inline int irand() { return idist(gen); }
-inline Float frand() { return dist(gen); }
-inline Float frand2() { return dist2(gen); }
+// PCG32 generator, cheap enough to reseed for every sample so that a pixel's
+// samples only depend on the render seed and not on thread or process layout.
+struct Rng {
+  typedef uint32_t result_type;
+  Rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0) {
+    this->seed(seed, stream);
+  }
+  inline void seed(uint64_t seed, uint64_t stream = 0) {
+    state = 0u;
+    inc = (stream << 1u) | 1u;
+    (*this)();
+    state += seed;
+    (*this)();
+  }
+  inline result_type operator()() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = static_cast<uint32_t>(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xffffffffu; }
+  uint64_t state, inc;
+};
+
+inline Rng &rng() {
+  static thread_local Rng gen(std::random_device{}(), std::random_device{}());
+  return gen;
+}
+inline uint64_t mix_seed(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+// Reseeds the calling thread's generator for sample `sample` of pixel
+// `pixel`.
+inline void seed(uint64_t seed, uint64_t pixel, uint64_t sample = 0) {
+  rng().seed(mix_seed(seed ^ mix_seed(sample)), pixel);
+}
+
+inline int irand() { return static_cast<int>(rng()() >> 1); }
+inline Float frand() { return (rng()() >> 8) * (1.0f / 16777216.0f); }
+inline Float frand2() { return frand() * 2.0f - 1.0f; }
 inline Float frand(const Float &min, const Float &max) {
-  return dist(gen) * (max - min) + min;
+  return frand() * (max - min) + min;
 }
 } // namespace trm
 
@@ -1,11 +1,26 @@
 #include "scene.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <random>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "camera.hpp"
 #include "material.hpp"
+#include "opt.hpp"
+#include "pack.hpp"
 #include "rand.hpp"
 #include "sdf.hpp"
 #include "settings.hpp"
@@ -35,283 +50,726 @@ Float getf(const nlohmann::json &json) {
   }
 }
 
-bool trm::load_json(const std::string &file, RenderSettings *settings,
-                    Scene *scene) {
-  std::ifstream config_file(file);
-  if (!config_file.is_open()) {
-    std::fprintf(stderr, "Failed to load JSON file \"%s\"\n", file.c_str());
-    return false;
-  }
-  nlohmann::json json;
-  config_file >> json;
-  config_file.close();
+// A vector given as [x, y, z] or as one number for all three components.
+Vec3 getv(const nlohmann::json &json) {
+  if (json.is_array())
+    return Vec3(getf(json.at(0)), getf(json.at(1)), getf(json.at(2)));
+  return Vec3(getf(json));
+}
 
-  if (json.contains("maximumDistance")) {
-    settings->maximum_distance = json.at("maximumDistance").get<Float>();
-  }
-  if (json.contains("epsilonDistance")) {
-    settings->epsilon_distance = json.at("epsilonDistance").get<Float>();
+namespace {
+std::shared_ptr<trm::Sdf> copy_node(
+    const std::shared_ptr<trm::Sdf> &node,
+    std::map<const trm::Sdf *, std::shared_ptr<trm::Sdf>> &nodes,
+    std::map<const trm::Material *, std::shared_ptr<trm::Material>> &mats) {
+  if (node == nullptr)
+    return nullptr;
+  auto it = nodes.find(node.get());
+  if (it != nodes.end())
+    return it->second;
+  std::shared_ptr<trm::Sdf> copy = node->clone();
+  nodes[node.get()] = copy;
+  if (node->mat != nullptr) {
+    auto mit = mats.find(node->mat.get());
+    if (mit == mats.end()) {
+      copy->mat = std::make_shared<trm::Material>(*node->mat);
+      mats[node->mat.get()] = copy->mat;
+    } else {
+      copy->mat = mit->second;
+    }
   }
-  if (json.contains("resolution") &&
-      (settings->resolution.x == 0 || settings->resolution.y == 0)) {
-    nlohmann::json::iterator it = json.find("resolution");
-    if (it->is_array() && it->size() == 2) {
-      settings->resolution =
-          uvec2(it->at(0).get<unsigned int>(), it->at(1).get<unsigned int>());
-    } else if (it->is_number()) {
-      settings->resolution = uvec2(it->get<unsigned int>());
+  for (auto &child : trm::child_slots(copy.get()))
+    *child = copy_node(*child, nodes, mats);
+  return copy;
+}
+
+// Applies one top level setting of the scene file. Settings already given on
+// the command line take precedence.
+bool parse_setting(const std::string &key, const nlohmann::json &value,
+                   trm::RenderSettings *settings) {
+  if (key == "maximumDistance") {
+    settings->maximum_distance = value.get<Float>();
+  } else if (key == "epsilonDistance") {
+    settings->epsilon_distance = value.get<Float>();
+  } else if (key == "resolution" &&
+             (settings->resolution.x == 0 || settings->resolution.y == 0)) {
+    if (value.is_array() && value.size() == 2) {
+      settings->resolution = uvec2(value.at(0).get<unsigned int>(),
+                                   value.at(1).get<unsigned int>());
+    } else if (value.is_number()) {
+      settings->resolution = uvec2(value.get<unsigned int>());
     } else {
       std::fprintf(stderr, "Failed to parse \"resolution\"\n");
       return false;
     }
+  } else if (key == "maximumDepth" && settings->maximum_depth == 0) {
+    settings->maximum_depth = value.get<std::size_t>();
+  } else if (key == "spp" && settings->spp == 0) {
+    settings->spp = value.get<std::size_t>();
+  } else if (key == "progressBar" && settings->no_bar == false) {
+    settings->no_bar = !value.get<bool>();
+  } else if (key == "seed" && settings->seed == 0) {
+    settings->seed = value.get<std::size_t>();
+  } else if (key == "output" && settings->output_fmt == "") {
+    settings->output_fmt = value.get<std::string>();
+  }
+  return true;
+}
+
+void seed_scene(trm::RenderSettings *settings) {
+  if (settings->seed == 0) {
+    settings->seed = std::random_device{}();
   }
-  if (json.contains("maximumDepth") && settings->maximum_depth == 0) {
-    settings->maximum_depth = json.at("maximumDepth").get<std::size_t>();
+  trm::seed(settings->seed, std::numeric_limits<uint64_t>::max());
+}
+
+void parse_camera(const nlohmann::json &json, trm::Camera *camera) {
+  if (json.contains("fov")) {
+    camera->fov = json.at("fov").get<Float>();
   }
-  if (json.contains("spp") && settings->spp == 0) {
-    settings->spp = json.at("spp").get<std::size_t>();
+  if (json.contains("pos")) {
+    camera->pos = vec3(json.at("pos").at(0).get<Float>(),
+                       json.at("pos").at(1).get<Float>(),
+                       json.at("pos").at(2).get<Float>());
   }
-  if (json.contains("progressBar") && settings->no_bar == false) {
-    settings->no_bar = !json.at("progressBar").get<bool>();
+  if (json.contains("center")) {
+    camera->center = vec3(json.at("center").at(0).get<Float>(),
+                          json.at("center").at(1).get<Float>(),
+                          json.at("center").at(2).get<Float>());
   }
-  if (json.contains("output") && settings->output_fmt == "") {
-    settings->output_fmt = json.at("output").get<std::string>();
+  if (json.contains("up")) {
+    camera->up = vec3(json.at("up").at(0).get<Float>(),
+                      json.at("up").at(1).get<Float>(),
+                      json.at("up").at(2).get<Float>());
   }
+}
 
-  if (json.contains("camera")) {
-    nlohmann::json::iterator it = json.find("camera");
-    if (it->contains("fov")) {
-      scene->camera.fov = it->at("fov").get<Float>();
-    }
-    if (it->contains("pos")) {
-      scene->camera.pos = vec3(it->at("pos").at(0).get<Float>(),
-                               it->at("pos").at(1).get<Float>(),
-                               it->at("pos").at(2).get<Float>());
-    }
-    if (it->contains("center")) {
-      scene->camera.center = vec3(it->at("center").at(0).get<Float>(),
-                                  it->at("center").at(1).get<Float>(),
-                                  it->at("center").at(2).get<Float>());
-    }
-    if (it->contains("up")) {
-      scene->camera.up =
-          vec3(it->at("up").at(0).get<Float>(), it->at("up").at(1).get<Float>(),
-               it->at("up").at(2).get<Float>());
-    }
+std::shared_ptr<trm::Material> parse_material(const nlohmann::json &entry) {
+  trm::Material::Shading shading = trm::Material::DIFF;
+  Float emission = 0.0f, ior = 0.0f;
+  Vec3 color(1.0f);
+  if (entry.contains("shading")) {
+    std::string key = entry.at("shading").get<std::string>();
+    if (key == "diffuse")
+      shading = trm::Material::DIFF;
+    else if (key == "specular")
+      shading = trm::Material::SPEC;
+    else if (key == "refractive")
+      shading = trm::Material::REFR;
+    else if (key == "emissive")
+      shading = trm::Material::EMIS;
+  }
+  if (entry.contains("emission")) {
+    emission = getf(entry.at("emission"));
   }
+  if (entry.contains("ior")) {
+    ior = getf(entry.at("ior"));
+  }
+  if (entry.contains("color")) {
+    color = Vec3(getf(entry.at("color").at(0)), getf(entry.at("color").at(1)),
+                 getf(entry.at("color").at(2)));
+  }
+  std::shared_ptr<trm::Material> mat =
+      std::make_shared<trm::Material>(shading, color, emission, ior);
+  if (entry.contains("trapColor")) {
+    mat->trap = true;
+    mat->trap_color = getv(entry.at("trapColor"));
+  }
+  return mat;
+}
 
-  std::map<std::string, std::shared_ptr<trm::Material>> material_index;
-  if (json.contains("materials")) {
-    nlohmann::json::iterator materials = json.find("materials");
-    for (nlohmann::json::iterator it = materials->begin();
-         it != materials->end(); ++it) {
-      trm::Material::Shading shading = trm::Material::DIFF;
-      Float emission = 0.0f, ior = 0.0f;
-      Vec3 color(1.0f);
-      if (it->contains("shading")) {
-        std::string key = it->at("shading").get<std::string>();
-        if (key == "diffuse")
-          shading = trm::Material::DIFF;
-        else if (key == "specular")
-          shading = trm::Material::SPEC;
-        else if (key == "refractive")
-          shading = trm::Material::REFR;
-        else if (key == "emissive")
-          shading = trm::Material::EMIS;
-      }
-      if (it->contains("emission")) {
-        emission = getf(it->at("emission"));
-      }
-      if (it->contains("ior")) {
-        ior = getf(it->at("ior"));
-      }
-      if (it->contains("color")) {
-        color = Vec3(getf(it->at("color").at(0)), getf(it->at("color").at(1)),
-                     getf(it->at("color").at(2)));
-      }
-      scene->materials.push_back(
-          std::make_shared<trm::Material>(shading, color, emission, ior));
-      material_index[it.key()] = scene->materials.back();
+// Builds one object with its transforms applied. The names of the objects it
+// refers to are stored in `links` ("" when unused) for the caller to resolve
+// once every object is known. Returns nullptr for unknown types.
+std::shared_ptr<trm::Sdf>
+parse_object(const nlohmann::json &entry,
+             const std::shared_ptr<trm::Material> &material_ptr,
+             std::array<std::string, 2> *links) {
+  std::shared_ptr<trm::Sdf> obj;
+  bool binary = false;
+  *links = {"", ""};
+  std::string type =
+      entry.contains("type") ? entry.at("type").get<std::string>() : "";
+  if (type == "sphere") {
+    obj = sdfSphere(getf(entry.at("radius")), material_ptr);
+  } else if (type == "box") {
+    obj = sdfBox(getf(entry.at("dim").at(0)), getf(entry.at("dim").at(1)),
+                 getf(entry.at("dim").at(2)), material_ptr);
+  } else if (type == "cylinder") {
+    obj = sdfCylinder(getf(entry.at("height")), getf(entry.at("radius")),
+                      material_ptr);
+  } else if (type == "torus") {
+    obj = sdfTorus(getf(entry.at("radiusRevolve")), getf(entry.at("radius")),
+                   material_ptr);
+  } else if (type == "plane") {
+    obj = sdfPlane(
+        getf(entry.at("normal").at(0)), getf(entry.at("normal").at(1)),
+        getf(entry.at("normal").at(2)),
+        entry.at("normal").size() >= 4 ? getf(entry.at("normal").at(3)) : 0.0f,
+        material_ptr);
+  } else if (type == "pyramid") {
+    obj = sdfPyramid(getf(entry.at("height")), material_ptr);
+  } else if (type == "mengerSponge") {
+    obj = sdfMengerSponge(
+        static_cast<std::size_t>(getf(entry.at("iterations"))), material_ptr);
+  } else if (type == "serpinskiTetrahedron") {
+    obj = sdfSerpinskiTetrahedron(
+        static_cast<std::size_t>(getf(entry.at("iterations"))), material_ptr);
+  } else if (type == "kifs") {
+    std::string symmetry = entry.contains("symmetry")
+                               ? entry.at("symmetry").get<std::string>()
+                               : "octahedral";
+    obj = sdfKifs(static_cast<std::size_t>(getf(entry.at("iterations"))),
+                  symmetry == "tetrahedral" ? trm::Kifs::TETRAHEDRAL
+                                            : trm::Kifs::OCTAHEDRAL,
+                  entry.contains("factor") ? getf(entry.at("factor")) : 2.0f,
+                  entry.contains("offset") ? getv(entry.at("offset"))
+                                           : Vec3(1.0f),
+                  entry.contains("angles") ? getv(entry.at("angles"))
+                                           : Vec3(0.0f),
+                  material_ptr);
+  } else if (type == "mandelbulb") {
+    obj = sdfMandelbulb(
+        static_cast<std::size_t>(getf(entry.at("iterations"))),
+        entry.contains("power") ? getf(entry.at("power")) : 8.0f,
+        material_ptr);
+  } else if (type == "mandelbox") {
+    obj = sdfMandelbox(
+        static_cast<std::size_t>(getf(entry.at("iterations"))),
+        entry.contains("factor") ? getf(entry.at("factor")) : 2.0f,
+        entry.contains("minRadius") ? getf(entry.at("minRadius")) : 0.5f,
+        entry.contains("fixedRadius") ? getf(entry.at("fixedRadius")) : 1.0f,
+        entry.contains("foldingLimit") ? getf(entry.at("foldingLimit"))
+                                       : 1.0f,
+        material_ptr);
+  } else if (type == "elongate") {
+    obj = sdfElongate(nullptr,
+                      Vec3(getf(entry.at("scale").at(0)),
+                           getf(entry.at("scale").at(1)),
+                           entry.at("scale").at(2)),
+                      material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "round") {
+    obj = sdfRound(nullptr, getf(entry.at("radius")), material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "onion") {
+    obj = sdfOnion(nullptr, getf(entry.at("thickness")), material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "repeat") {
+    if (entry.contains("limit")) {
+      obj = sdfLimitedRepeat(nullptr, getv(entry.at("period")),
+                             getv(entry.at("limit")), material_ptr);
+    } else {
+      obj = sdfRepeat(nullptr, getv(entry.at("period")), material_ptr);
     }
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "mirror") {
+    std::string axes =
+        entry.contains("axes") ? entry.at("axes").get<std::string>() : "x";
+    obj = sdfMirror(nullptr,
+                    Vec3(axes.find('x') != std::string::npos ? 1.0f : 0.0f,
+                         axes.find('y') != std::string::npos ? 1.0f : 0.0f,
+                         axes.find('z') != std::string::npos ? 1.0f : 0.0f),
+                    material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "polarRepeat") {
+    obj = sdfPolarRepeat(
+        nullptr,
+        std::max<std::size_t>(1, static_cast<std::size_t>(
+                                     getf(entry.at("count")))),
+        material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "instance") {
+    obj = sdfInstance(nullptr, material_ptr);
+    (*links)[0] = entry.at("object").get<std::string>();
+  } else if (type == "union") {
+    obj = sdfUnion(nullptr, nullptr, material_ptr);
+    binary = true;
+  } else if (type == "subtraction") {
+    obj = sdfSubtraction(nullptr, nullptr, material_ptr);
+    binary = true;
+  } else if (type == "intersection") {
+    obj = sdfIntersection(nullptr, nullptr, material_ptr);
+    binary = true;
+  } else if (type == "smoothUnion") {
+    obj = sdfSmoothUnion(nullptr, nullptr, getf(entry.at("radius")),
+                         material_ptr);
+    binary = true;
+  } else if (type == "smoothSubtraction") {
+    obj = sdfSmoothSubtraction(nullptr, nullptr, getf(entry.at("radius")),
+                               material_ptr);
+    binary = true;
+  } else if (type == "smoothIntersection") {
+    obj = sdfSmoothIntersection(nullptr, nullptr, getf(entry.at("radius")),
+                                material_ptr);
+    binary = true;
+  } else {
+    return nullptr;
   }
-
-  std::map<std::shared_ptr<trm::Sdf>, std::array<std::string, 2>>
-      linked_objects;
-  std::map<std::string, std::shared_ptr<trm::Sdf>> object_index;
-  if (json.contains("objects")) {
-    nlohmann::json::iterator objects = json.find("objects");
-    for (nlohmann::json::iterator it = objects->begin(); it != objects->end();
-         ++it) {
-      std::shared_ptr<trm::Material> material_ptr =
-          it->contains("material")
-              ? material_index[it->at("material").get<std::string>()]
-              : nullptr;
-      std::string type =
-          it->contains("type") ? it->at("type").get<std::string>() : "";
-      if (type == "sphere") {
-        scene->objects.push_back(
-            sdfSphere(getf(it->at("radius")), material_ptr));
-      } else if (type == "box") {
-        scene->objects.push_back(
-            sdfBox(getf(it->at("dim").at(0)), getf(it->at("dim").at(1)),
-                   getf(it->at("dim").at(2)), material_ptr));
-      } else if (type == "cylinder") {
-        scene->objects.push_back(sdfCylinder(
-            getf(it->at("height")), getf(it->at("radius")), material_ptr));
-      } else if (type == "torus") {
-        scene->objects.push_back(sdfTorus(getf(it->at("radiusRevolve")),
-                                          getf(it->at("radius")),
-                                          material_ptr));
-      } else if (type == "plane") {
-        scene->objects.push_back(sdfPlane(
-            getf(it->at("normal").at(0)), getf(it->at("normal").at(1)),
-            getf(it->at("normal").at(2)),
-            it->at("normal").size() >= 4 ? getf(it->at("normal").at(3)) : 0.0f,
-            material_ptr));
-      } else if (type == "pyramid") {
-        scene->objects.push_back(
-            sdfPyramid(getf(it->at("height")), material_ptr));
-      } else if (type == "mengerSponge") {
-        scene->objects.push_back(sdfMengerSponge(
-            static_cast<std::size_t>(getf(it->at("iterations"))),
-            material_ptr));
-      } else if (type == "serpinskiTetrahedron") {
-        scene->objects.push_back(sdfSerpinskiTetrahedron(
-            static_cast<std::size_t>(getf(it->at("iterations"))),
-            material_ptr));
-      } else if (type == "elongate") {
-        scene->objects.push_back(sdfElongate(nullptr,
-                                             Vec3(getf(it->at("scale").at(0)),
-                                                  getf(it->at("scale").at(1)),
-                                                  it->at("scale").at(2)),
-                                             material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("object").get<std::string>(), ""};
-      } else if (type == "round") {
-        scene->objects.push_back(
-            sdfRound(nullptr, getf(it->at("radius")), material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("object").get<std::string>(), ""};
-      } else if (type == "onion") {
-        scene->objects.push_back(
-            sdfOnion(nullptr, getf(it->at("thickness")), material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("object").get<std::string>(), ""};
-      } else if (type == "union") {
-        scene->objects.push_back(sdfUnion(nullptr, nullptr, material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
-      } else if (type == "subtraction") {
-        scene->objects.push_back(
-            sdfSubtraction(nullptr, nullptr, material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
-      } else if (type == "intersection") {
-        scene->objects.push_back(
-            sdfIntersection(nullptr, nullptr, material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
-      } else if (type == "smoothUnion") {
-        scene->objects.push_back(sdfSmoothUnion(
-            nullptr, nullptr, getf(it->at("radius")), material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
-      } else if (type == "smoothSubtraction") {
-        scene->objects.push_back(sdfSmoothSubtraction(
-            nullptr, nullptr, getf(it->at("radius")), material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
-      } else if (type == "smoothIntersection") {
-        scene->objects.push_back(sdfSmoothIntersection(
-            nullptr, nullptr, getf(it->at("radius")), material_ptr));
-        linked_objects[scene->objects.back()] = {
-            it->at("a").get<std::string>(), it->at("b").get<std::string>()};
+  if (binary) {
+    *links = {entry.at("a").get<std::string>(),
+              entry.at("b").get<std::string>()};
+  }
+  if (entry.contains("scale")) {
+    if (entry.at("scale").is_number()) {
+      obj->scale(Vec3(getf(entry.at("scale"))));
+    } else {
+      obj->scale(Vec3(getf(entry.at("scale").at(0)),
+                      getf(entry.at("scale").at(1)),
+                      getf(entry.at("scale").at(2))));
+    }
+  }
+  if (entry.contains("rotation")) {
+    if (entry.at("rotation").is_array()) {
+      if (entry.at("rotation").at(0).is_number()) {
+        obj->rotate(getf(entry.at("rotation").at(0)), Vec3(1.0f, 0.0f, 0.0f))
+            ->rotate(getf(entry.at("rotation").at(1)), Vec3(0.0f, 1.0f, 0.0f))
+            ->rotate(getf(entry.at("rotation").at(2)),
+                     Vec3(0.0f, 0.0f, 1.0f));
       } else {
-        std::fprintf(stderr, "Every object must have a specific type\n");
-        return false;
-      }
-      if (it->contains("scale")) {
-        if (it->at("scale").is_number()) {
-          scene->objects.back()->scale(Vec3(getf(it->at("scale"))));
-        } else {
-          scene->objects.back()->scale(Vec3(getf(it->at("scale").at(0)),
-                                            getf(it->at("scale").at(1)),
-                                            getf(it->at("scale").at(2))));
-        }
-      }
-      if (it->contains("rotation")) {
-        if (it->at("rotation").is_array()) {
-          if (it->at("rotation").at(0).is_number()) {
-            scene->objects.back()
-                ->rotate(getf(it->at("rotation").at(0)), Vec3(1.0f, 0.0f, 0.0f))
-                ->rotate(getf(it->at("rotation").at(1)), Vec3(0.0f, 1.0f, 0.0f))
-                ->rotate(getf(it->at("rotation").at(2)),
-                         Vec3(0.0f, 0.0f, 1.0f));
-          } else {
-            for (auto &sit : it->at("rotation")) {
-              if (sit.is_array()) {
-                scene->objects.back()
-                    ->rotate(getf(sit.at(0)), Vec3(1.0f, 0.0f, 0.0f))
-                    ->rotate(getf(sit.at(1)), Vec3(0.0f, 1.0f, 0.0f))
-                    ->rotate(getf(sit.at(2)), Vec3(0.0f, 0.0f, 1.0f));
-              } else if (sit.is_object()) {
-                if (sit.contains("x")) {
-                  scene->objects.back()->rotate(getf(sit.at("x")),
-                                                Vec3(1.0f, 0.0f, 0.0f));
-                }
-                if (sit.contains("y")) {
-                  scene->objects.back()->rotate(getf(sit.at("y")),
-                                                Vec3(0.0f, 1.0f, 0.0f));
-                }
-                if (sit.contains("z")) {
-                  scene->objects.back()->rotate(getf(sit.at("z")),
-                                                Vec3(0.0f, 0.0f, 1.0f));
-                }
-                if (sit.contains("angle") && sit.contains("axis")) {
-                  scene->objects.back()->rotate(
-                      getf(sit.at("angle")), Vec3(getf(sit.at("axis").at(0)),
-                                                  getf(sit.at("axis").at(1)),
-                                                  getf(sit.at("axis").at(2))));
-                }
-              }
+        for (auto &sit : entry.at("rotation")) {
+          if (sit.is_array()) {
+            obj->rotate(getf(sit.at(0)), Vec3(1.0f, 0.0f, 0.0f))
+                ->rotate(getf(sit.at(1)), Vec3(0.0f, 1.0f, 0.0f))
+                ->rotate(getf(sit.at(2)), Vec3(0.0f, 0.0f, 1.0f));
+          } else if (sit.is_object()) {
+            if (sit.contains("x")) {
+              obj->rotate(getf(sit.at("x")), Vec3(1.0f, 0.0f, 0.0f));
+            }
+            if (sit.contains("y")) {
+              obj->rotate(getf(sit.at("y")), Vec3(0.0f, 1.0f, 0.0f));
+            }
+            if (sit.contains("z")) {
+              obj->rotate(getf(sit.at("z")), Vec3(0.0f, 0.0f, 1.0f));
+            }
+            if (sit.contains("angle") && sit.contains("axis")) {
+              obj->rotate(getf(sit.at("angle")),
+                          Vec3(getf(sit.at("axis").at(0)),
+                               getf(sit.at("axis").at(1)),
+                               getf(sit.at("axis").at(2))));
             }
-          }
-        } else {
-          nlohmann::json rotate = it->at("rotation");
-          if (rotate.contains("x")) {
-            scene->objects.back()->rotate(getf(rotate.at("x")),
-                                          Vec3(1.0f, 0.0f, 0.0f));
-          }
-          if (rotate.contains("y")) {
-            scene->objects.back()->rotate(getf(rotate.at("y")),
-                                          Vec3(0.0f, 1.0f, 0.0f));
-          }
-          if (rotate.contains("z")) {
-            scene->objects.back()->rotate(getf(rotate.at("z")),
-                                          Vec3(0.0f, 0.0f, 1.0f));
-          }
-          if (rotate.contains("angle") && rotate.contains("axis")) {
-            scene->objects.back()->rotate(getf(rotate.at("angle")),
-                                          Vec3(getf(rotate.at("axis").at(0)),
-                                               getf(rotate.at("axis").at(1)),
-                                               getf(rotate.at("axis").at(2))));
           }
         }
       }
-      if (it->contains("position")) {
-        scene->objects.back()->translate(Vec3(getf(it->at("position").at(0)),
-                                              getf(it->at("position").at(1)),
-                                              getf(it->at("position").at(2))));
+    } else {
+      const nlohmann::json &rotate = entry.at("rotation");
+      if (rotate.contains("x")) {
+        obj->rotate(getf(rotate.at("x")), Vec3(1.0f, 0.0f, 0.0f));
+      }
+      if (rotate.contains("y")) {
+        obj->rotate(getf(rotate.at("y")), Vec3(0.0f, 1.0f, 0.0f));
+      }
+      if (rotate.contains("z")) {
+        obj->rotate(getf(rotate.at("z")), Vec3(0.0f, 0.0f, 1.0f));
+      }
+      if (rotate.contains("angle") && rotate.contains("axis")) {
+        obj->rotate(getf(rotate.at("angle")),
+                    Vec3(getf(rotate.at("axis").at(0)),
+                         getf(rotate.at("axis").at(1)),
+                         getf(rotate.at("axis").at(2))));
       }
-      object_index[it.key()] = scene->objects.back();
     }
   }
+  if (entry.contains("position")) {
+    obj->translate(Vec3(getf(entry.at("position").at(0)),
+                        getf(entry.at("position").at(1)),
+                        getf(entry.at("position").at(2))));
+  }
+  return obj;
+}
+
+// SAX handler that rebuilds a small DOM for one value at a time instead of
+// the whole file: every top level value except "materials" and "objects",
+// and every entry of those two. Each finished value is handed to `emit` with
+// its section and entry name, and dropped as soon as it returns unless it was
+// moved from.
+class SceneSax : public nlohmann::json_sax<nlohmann::json> {
+public:
+  typedef std::function<bool(const std::string &section,
+                             const std::string &name,
+                             nlohmann::json &value)>
+      Emit;
+
+  explicit SceneSax(const Emit &emit) : emit(emit) {}
 
-  for (auto &obj : linked_objects) {
-    obj.first->a = object_index[obj.second[0]];
-    if (obj.second[1] != "")
-      obj.first->b = object_index[obj.second[1]];
+  bool null() override { return put(nullptr); }
+  bool boolean(bool val) override { return put(val); }
+  bool number_integer(number_integer_t val) override { return put(val); }
+  bool number_unsigned(number_unsigned_t val) override { return put(val); }
+  bool number_float(number_float_t val, const string_t &) override {
+    return put(val);
   }
+  bool string(string_t &val) override { return put(std::move(val)); }
+  bool binary(binary_t &) override { return false; }
 
+  bool start_object(std::size_t) override {
+    if (stack.empty() && depth == 0) {
+      depth = 1;
+      return true;
+    } else if (stack.empty() && depth == 1 &&
+               (section == "materials" || section == "objects")) {
+      depth = 2;
+      return true;
+    }
+    return put(nlohmann::json::object());
+  }
+  bool key(string_t &val) override {
+    if (!stack.empty())
+      member = val;
+    else if (depth == 1)
+      section = val;
+    else
+      name = val;
+    return true;
+  }
+  bool end_object() override {
+    if (stack.empty()) {
+      depth--;
+      return true;
+    }
+    return pop();
+  }
+  bool start_array(std::size_t) override {
+    return put(nlohmann::json::array());
+  }
+  bool end_array() override { return pop(); }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &ex) override {
+    std::fprintf(stderr, "%s\n", ex.what());
+    return false;
+  }
+
+private:
+  template <typename T> bool put(T &&val) {
+    if (depth == 0) {
+      std::fprintf(stderr, "Scene file must be a JSON object\n");
+      return false;
+    }
+    nlohmann::json *ref;
+    if (stack.empty()) {
+      value = std::forward<T>(val);
+      ref = &value;
+    } else if (stack.back()->is_object()) {
+      ref = &(*stack.back())[member];
+      *ref = std::forward<T>(val);
+    } else {
+      stack.back()->push_back(std::forward<T>(val));
+      ref = &stack.back()->back();
+    }
+    if (ref->is_structured()) {
+      stack.push_back(ref);
+      return true;
+    }
+    return stack.empty() ? finish() : true;
+  }
+  bool pop() {
+    stack.pop_back();
+    return stack.empty() ? finish() : true;
+  }
+  bool finish() {
+    bool ok = emit(section, depth == 2 ? name : "", value);
+    value = nullptr;
+    return ok;
+  }
+
+  Emit emit;
+  std::size_t depth = 0;
+  std::string section, name, member;
+  nlohmann::json value;
+  std::vector<nlohmann::json *> stack;
+};
+
+// Fills `scene->media` from the enclosing spheres of the rendered objects.
+// Objects whose value at the center of a medium rules out a surface within
+// its radius are left out too, which covers unbounded ones such as planes.
+void find_media(trm::Scene *scene) {
+  const std::vector<std::shared_ptr<trm::Sdf>> &objects = scene->objects;
+  std::vector<Vec3> centers(objects.size());
+  std::vector<Float> radii(objects.size());
+  for (std::size_t i = 0; i < objects.size(); ++i)
+    trm::enclosing_sphere(*objects[i], &centers[i], &radii[i]);
+  scene->media.clear();
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    if (objects[i]->mat == nullptr ||
+        objects[i]->mat->type != trm::Material::REFR ||
+        radii[i] == std::numeric_limits<Float>::infinity())
+      continue;
+    trm::Medium medium{centers[i], radii[i], {i}};
+    for (std::size_t j = 0; j < objects.size(); ++j) {
+      if (j == i || objects[j]->mat == nullptr ||
+          length(centers[j] - centers[i]) > radii[i] + radii[j] ||
+          abs((*objects[j])(centers[i])) > objects[j]->lipschitz * radii[i])
+        continue;
+      medium.objects.push_back(j);
+    }
+    scene->media[objects[i].get()] = medium;
+  }
+}
+// Entry of "materials" or "objects" by name. Entries that draw no random
+// values may be built as soon as they are read, the others are kept as
+// `value` for `build_entries`.
+struct MaterialEntry {
+  nlohmann::json value;
+  std::shared_ptr<trm::Material> material;
+};
+struct ObjectEntry {
+  nlohmann::json value;
+  std::shared_ptr<trm::Sdf> obj;
+  std::string material;
+  std::array<std::string, 2> links;
+};
+
+bool draws_random(const nlohmann::json &value) {
+  if (value.is_string())
+    return !value.get_ref<const std::string &>().compare(0, 5, "rand(");
+  if (value.is_structured()) {
+    for (auto &item : value) {
+      if (draws_random(item))
+        return true;
+    }
+  }
+  return false;
+}
+
+void build_material(MaterialEntry *entry) {
+  entry->material = parse_material(entry->value);
+  entry->value = nullptr;
+}
+// Builds the object without its material and references, which are only
+// resolved once every entry is known.
+bool build_object(ObjectEntry *entry) {
+  entry->obj = parse_object(entry->value, nullptr, &entry->links);
+  if (entry->obj == nullptr) {
+    std::fprintf(stderr, "Every object must have a specific type\n");
+    return false;
+  }
+  if (entry->value.contains("material"))
+    entry->material = entry->value.at("material").get<std::string>();
+  entry->value = nullptr;
+  return true;
+}
+
+// Builds the entries not built yet, the materials and then the objects, each
+// in the order of their names, which is also the order they draw their
+// random values in. Then resolves the materials and references of the
+// objects.
+bool build_entries(std::map<std::string, MaterialEntry> *materials,
+                   std::map<std::string, ObjectEntry> *objects,
+                   trm::Scene *scene) {
+  for (auto &entry : *materials) {
+    if (entry.second.material == nullptr)
+      build_material(&entry.second);
+    scene->materials.push_back(entry.second.material);
+  }
+  for (auto &entry : *objects) {
+    if (entry.second.obj == nullptr && !build_object(&entry.second))
+      return false;
+    scene->objects.push_back(entry.second.obj);
+  }
+
+  auto material = [materials](const std::string &name) {
+    auto it = materials->find(name);
+    return it != materials->end() ? it->second.material : nullptr;
+  };
+  auto object = [objects](const std::string &name) {
+    auto it = objects->find(name);
+    return it != objects->end() ? it->second.obj : nullptr;
+  };
+  for (auto &entry : *objects) {
+    ObjectEntry &obj = entry.second;
+    if (obj.material != "")
+      obj.obj->mat = material(obj.material);
+    if (obj.links[0] != "")
+      obj.obj->a = object(obj.links[0]);
+    if (obj.links[1] != "")
+      obj.obj->b = object(obj.links[1]);
+  }
+  return true;
+}
+} // namespace
+
+bool trm::load_json(const std::string &file, RenderSettings *settings,
+                    Scene *scene) {
+  std::ifstream config_file(file);
+  if (!config_file.is_open()) {
+    std::fprintf(stderr, "Failed to load JSON file \"%s\"\n", file.c_str());
+    return false;
+  }
+  nlohmann::json json;
+  config_file >> json;
+  config_file.close();
+  scene->source = file;
+
+  for (auto it = json.begin(); it != json.end(); ++it) {
+    if (it.key() != "camera" && it.key() != "materials" &&
+        it.key() != "objects" && !parse_setting(it.key(), *it, settings))
+      return false;
+  }
+  seed_scene(settings);
+
+  if (json.contains("camera")) {
+    parse_camera(json.at("camera"), &scene->camera);
+  }
+
+  std::map<std::string, MaterialEntry> materials;
+  std::map<std::string, ObjectEntry> objects;
+  if (json.contains("materials")) {
+    nlohmann::json::iterator entries = json.find("materials");
+    for (auto it = entries->begin(); it != entries->end(); ++it)
+      materials[it.key()].value = std::move(*it);
+  }
+  if (json.contains("objects")) {
+    nlohmann::json::iterator entries = json.find("objects");
+    for (auto it = entries->begin(); it != entries->end(); ++it)
+      objects[it.key()].value = std::move(*it);
+  }
+  return build_entries(&materials, &objects, scene);
+}
+
+bool trm::load_json_sax(const std::string &file, RenderSettings *settings,
+                        Scene *scene) {
+  auto start = std::chrono::steady_clock::now();
+  int fd = open(file.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::fprintf(stderr, "Failed to load JSON file \"%s\"\n", file.c_str());
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  std::size_t size = st.st_size;
+  void *map = size != 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                        : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::fprintf(stderr, "Failed to map JSON file \"%s\"\n", file.c_str());
+    return false;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  scene->source = file;
+
+  // Settings apply as they come. Entries that draw random values are kept
+  // until the file is parsed, since the seed and the entries before them in
+  // the order of names may come later, and are then built the way load_json
+  // builds them. Later entries of the same name replace earlier ones, as
+  // they do in the DOM.
+  nlohmann::json camera;
+  std::map<std::string, MaterialEntry> materials;
+  std::map<std::string, ObjectEntry> objects;
+  SceneSax handler([&](const std::string &section, const std::string &name,
+                       nlohmann::json &value) {
+    if (section == "camera") {
+      camera = std::move(value);
+      return true;
+    } else if (section != "materials" && section != "objects") {
+      return parse_setting(section, value, settings);
+    }
+    if (name == "") {
+      std::fprintf(stderr, "\"%s\" must be a JSON object\n", section.c_str());
+      return false;
+    }
+    bool deferred = draws_random(value);
+    if (section == "materials") {
+      MaterialEntry &entry = materials[name] = MaterialEntry();
+      entry.value = std::move(value);
+      if (!deferred)
+        build_material(&entry);
+      return true;
+    }
+    ObjectEntry &entry = objects[name] = ObjectEntry();
+    entry.value = std::move(value);
+    return deferred || build_object(&entry);
+  });
+  const char *begin = static_cast<const char *>(map);
+  bool ok = nlohmann::json::sax_parse(begin, begin + size, &handler);
+  munmap(map, size);
+  if (!ok) {
+    std::fprintf(stderr, "Failed to parse JSON file \"%s\"\n", file.c_str());
+    return false;
+  }
+  seed_scene(settings);
+  if (!camera.is_null())
+    parse_camera(camera, &scene->camera);
+  if (!build_entries(&materials, &objects, scene))
+    return false;
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  double mb = size / (1024.0 * 1024.0);
+  std::printf("Parsed \"%s\": %.1f MB in %.3fs (%.1f MB/s), %lu objects, %lu "
+              "materials\n",
+              file.c_str(), mb, seconds, seconds > 0.0 ? mb / seconds : 0.0,
+              scene->objects.size(), scene->materials.size());
   return true;
 }
+
+bool trm::load_scene(const std::string &file, RenderSettings *settings,
+                     Scene *scene) {
+  const std::string ext = ".trmb";
+  bool ok;
+  if (file.size() >= ext.size() &&
+      file.compare(file.size() - ext.size(), ext.size(), ext) == 0) {
+    ok = load_packed(file, settings, scene);
+    if (ok)
+      trm::seed(settings->seed, std::numeric_limits<uint64_t>::max());
+  } else if (settings->sax_loader) {
+    ok = load_json_sax(file, settings, scene);
+  } else {
+    ok = load_json(file, settings, scene);
+  }
+  if (!ok)
+    return false;
+  opt::Stats before = {0, 0, 0.0f};
+  if (settings->optimize) {
+    before = opt::measure(*scene);
+    opt::optimize(scene);
+  }
+  std::size_t merged = merge_identical(&scene->objects);
+  std::size_t shared = memoize_shared(scene->objects);
+  compute_bounds(scene->objects);
+  if (merged != 0 || shared != 0)
+    std::printf("Shared nodes:   %lu merged, %lu evaluated once per point\n",
+                merged, shared);
+  if (settings->analytic) {
+    std::vector<std::shared_ptr<Sdf>> marched;
+    for (auto &obj : scene->objects) {
+      if (obj->mat != nullptr && analytic(*obj))
+        scene->analytic.push_back(obj);
+      else
+        marched.push_back(obj);
+    }
+    scene->objects = marched;
+    std::printf("Analytic:       %lu objects intersected directly\n",
+                scene->analytic.size());
+  }
+  find_media(scene);
+  if (settings->optimize) {
+    opt::Stats after = opt::measure(*scene);
+    std::printf("Optimized:      %lu -> %lu nodes, %lu -> %lu materials, cost "
+                "%.0f -> %.0f per query\n",
+                before.nodes, after.nodes, before.materials, after.materials,
+                before.cost, after.cost);
+  }
+  return true;
+}
+
+void trm::copy_scene(const Scene &src, Scene *dst) {
+  std::map<const trm::Sdf *, std::shared_ptr<trm::Sdf>> nodes;
+  std::map<const trm::Material *, std::shared_ptr<trm::Material>> mats;
+  dst->camera = src.camera;
+  dst->source = src.source;
+  dst->materials.clear();
+  dst->objects.clear();
+  dst->analytic.clear();
+  for (auto &mat : src.materials) {
+    dst->materials.push_back(std::make_shared<trm::Material>(*mat));
+    mats[mat.get()] = dst->materials.back();
+  }
+  for (auto &obj : src.objects)
+    dst->objects.push_back(copy_node(obj, nodes, mats));
+  for (auto &obj : src.analytic)
+    dst->analytic.push_back(copy_node(obj, nodes, mats));
+  find_media(dst);
+}
@@ -2,6 +2,8 @@
 #define TRM_SCENE_HPP_
 
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "camera.hpp"
@@ -10,13 +12,44 @@
 #include "settings.hpp"
 
 namespace trm {
+// Objects a ray inside a refractive object can meet before it leaves the
+// object's enclosing sphere: the indices of those whose surfaces may cross
+// that sphere, the object itself first.
+struct Medium {
+  Vec3 center;
+  Float radius;
+  std::vector<std::size_t> objects;
+};
+
 struct Scene {
   std::vector<std::shared_ptr<trm::Material>> materials;
   std::vector<std::shared_ptr<trm::Sdf>> objects;
+  // Rendered objects intersected in closed form instead of marched, split
+  // out of `objects` by `load_scene` with `settings->analytic`.
+  std::vector<std::shared_ptr<trm::Sdf>> analytic;
+  // Bounded refractive objects among `objects`, filled by `load_scene`.
+  std::unordered_map<const trm::Sdf *, Medium> media;
   trm::Camera camera;
+  std::string source;
 };
 
 bool load_json(const std::string &file, RenderSettings *settings, Scene *scene);
+// Streams the file through a SAX parser and builds every material and object
+// that draws no random values as soon as its entry is complete, without
+// holding the document in memory. Builds the same scene as `load_json`.
+// Prints the parse throughput.
+bool load_json_sax(const std::string &file, RenderSettings *settings,
+                   Scene *scene);
+// Loads packed scenes (".trmb") with `load_packed`, and anything else as JSON
+// with `load_json_sax` when `settings->sax_loader` is set or `load_json`.
+// The scene graph is then optimized when `settings->optimize` is set,
+// identical subtrees are merged and shared nodes memoized, and `analytic`
+// top level objects split out when `settings->analytic` is set. Last, the
+// media of refractive objects are found.
+bool load_scene(const std::string &file, RenderSettings *settings,
+                Scene *scene);
+// Deep copy of every node and material, allocated by the calling thread.
+void copy_scene(const Scene &src, Scene *dst);
 } // namespace trm
 
 #endif // TRM_SCENE_HPP_
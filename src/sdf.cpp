@@ -1,21 +1,348 @@
 #include "sdf.hpp"
+#include "kernel.hpp"
 #include "type.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <limits>
+#include <map>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+// Value `d` at `p`, evaluated with the footprint `footprint` since fractals
+// give other values at other footprints.
+struct MemoEntry {
+  Vec3 p;
+  Float d, footprint;
+  uint32_t epoch;
+};
+thread_local std::vector<MemoEntry> memo_cache;
+std::atomic<uint32_t> next_epoch(1);
+
+// Counts the paths from the evaluated objects to every node, stopping at two
+// since that is enough to make a node shared.
+void count_paths(trm::Sdf *node, std::map<trm::Sdf *, int> *paths) {
+  if (node == nullptr)
+    return;
+  int &count = (*paths)[node];
+  if (++count > 1) {
+    count = 2;
+    return;
+  }
+  for (auto &child : trm::child_slots(node))
+    count_paths(child->get(), paths);
+}
+
+template <typename T> void append(std::string *key, const T &value) {
+  key->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Replaces the children of `node` by their canonical versions and returns the
+// canonical version of `node` itself: the first node seen with the same kind,
+// parameters, transform, material and canonical children.
+std::shared_ptr<trm::Sdf>
+canonical(const std::shared_ptr<trm::Sdf> &node,
+          std::map<const trm::Sdf *, std::shared_ptr<trm::Sdf>> *done,
+          std::unordered_map<std::string, std::shared_ptr<trm::Sdf>> *unique) {
+  if (node == nullptr)
+    return nullptr;
+  auto it = done->find(node.get());
+  if (it != done->end())
+    return it->second;
+  std::vector<std::shared_ptr<trm::Sdf> *> children =
+      trm::child_slots(node.get());
+  for (auto &child : children)
+    *child = canonical(*child, done, unique);
+  std::string key;
+  append(&key, node->kind());
+  for (auto &param : trm::node_params(*node))
+    append(&key, param);
+  append(&key, node->trans);
+  append(&key, node->inv);
+  append(&key, node->mat.get());
+  append(&key, node->a.get());
+  append(&key, node->b.get());
+  for (auto &child : children)
+    append(&key, child->get());
+  std::shared_ptr<trm::Sdf> result = unique->emplace(key, node).first->second;
+  (*done)[node.get()] = result;
+  return result;
+}
+
+struct Bound {
+  Vec3 center;
+  Float radius, scale;
+};
+const Float unbounded = std::numeric_limits<Float>::infinity();
+
+// Largest singular value of the linear part of `m`, from the largest
+// eigenvalue of its Gram matrix.
+double largest_singular(const Mat4 &m) {
+  double a[3][3];
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      a[i][j] = 0.0;
+      for (int k = 0; k < 3; ++k)
+        a[i][j] += double(m[i][k]) * double(m[j][k]);
+    }
+  }
+  double p1 = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+  double q = (a[0][0] + a[1][1] + a[2][2]) / 3.0;
+  double p2 = (a[0][0] - q) * (a[0][0] - q) + (a[1][1] - q) * (a[1][1] - q) +
+              (a[2][2] - q) * (a[2][2] - q) + 2.0 * p1;
+  if (p2 <= 0.0)
+    return std::sqrt(q);
+  double p = std::sqrt(p2 / 6.0);
+  double b[3][3];
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j)
+      b[i][j] = (a[i][j] - (i == j ? q : 0.0)) / p;
+  }
+  double r = (b[0][0] * (b[1][1] * b[2][2] - b[1][2] * b[2][1]) -
+              b[0][1] * (b[1][0] * b[2][2] - b[1][2] * b[2][0]) +
+              b[0][2] * (b[1][0] * b[2][1] - b[1][1] * b[2][0])) /
+             2.0;
+  double phi = std::acos(std::min(1.0, std::max(-1.0, r))) / 3.0;
+  return std::sqrt(std::max(0.0, q + 2.0 * p * std::cos(phi)));
+}
+
+// Bound of a child in the frame of its parent.
+Bound child_bound(const trm::Sdf &child) {
+  Bound bound{child.bound_center, child.bound_radius, child.bound_scale};
+  if (child.transformed && bound.radius != unbounded) {
+    bound.center = Vec3(child.trans * Vec4(bound.center, 1.0f));
+    bound.scale /= Float(largest_singular(child.trans) * (1.0 + 1e-4));
+  }
+  return bound;
+}
+
+// Smallest sphere bounding the minimum of both.
+Bound unite(const Bound &a, const Bound &b) {
+  if (a.radius == unbounded || b.radius == unbounded)
+    return {Vec3(0.0f), unbounded, 1.0f};
+  Float k = min(a.scale, b.scale);
+  Float d = length(b.center - a.center);
+  if (d == 0.0f)
+    return {a.center, max(a.radius, b.radius), k};
+  Float t = clamp((b.radius - a.radius + k * d) / (2.0f * k * d), 0.0f, 1.0f);
+  Vec3 center = a.center + t * (b.center - a.center);
+  return {center, max(a.radius + k * t * d, b.radius + k * (1.0f - t) * d),
+          k};
+}
+
+Bound own_bound(trm::Sdf *node) {
+  using trm::SdfKind;
+  const Float sqrt3 = std::sqrt(Float(3.0));
+  Bound a = node->a != nullptr ? child_bound(*node->a) : Bound();
+  Bound b = node->b != nullptr ? child_bound(*node->b) : Bound();
+  switch (node->kind()) {
+  case SdfKind::Sphere:
+    return {Vec3(0.0f), abs(static_cast<trm::Sphere *>(node)->radius), 1.0f};
+  case SdfKind::Box:
+    return {Vec3(0.0f), length(static_cast<trm::Box *>(node)->dim), 1.0f};
+  case SdfKind::Cylinder: {
+    trm::Cylinder *c = static_cast<trm::Cylinder *>(node);
+    return {Vec3(0.0f), length(Vec2(c->height, c->radius)), 1.0f};
+  }
+  case SdfKind::Torus: {
+    const Vec2 &t = static_cast<trm::Torus *>(node)->torus;
+    return {Vec3(0.0f), abs(t.x) + abs(t.y), 1.0f};
+  }
+  case SdfKind::Pyramid:
+    return {Vec3(0.0f),
+            max(std::sqrt(Float(0.5)),
+                abs(static_cast<trm::Pyramid *>(node)->height)),
+            1.0f};
+  case SdfKind::MengerSponge:
+  case SdfKind::SerpinskiTetrahedron:
+    return {Vec3(0.0f), sqrt3, 1.0f};
+  case SdfKind::Kifs: {
+    trm::Kifs *k = static_cast<trm::Kifs *>(node);
+    if (k->factor > 1.0f)
+      return {Vec3(0.0f), length(k->offset), 1.0f};
+  } break;
+  case SdfKind::Mandelbulb:
+    // Points beyond the bailout radius of 2 escape at once, where the
+    // estimate is 0.5 r log(r) >= 0.5 (r - 1).
+    return {Vec3(0.0f), 1.0f, 0.5f};
+  case SdfKind::Round:
+    a.radius += static_cast<trm::Round *>(node)->radius;
+    return a;
+  case SdfKind::Onion:
+    a.radius += static_cast<trm::Onion *>(node)->thickness;
+    return a;
+  case SdfKind::LimitedRepeat: {
+    trm::LimitedRepeat *r = static_cast<trm::LimitedRepeat *>(node);
+    a.radius += a.scale * length(r->period * r->limit);
+    return a;
+  }
+  case SdfKind::Mirror:
+  case SdfKind::PolarRepeat:
+    // Folding preserves the length of the point.
+    return {Vec3(0.0f), a.radius + a.scale * length(a.center), a.scale};
+  case SdfKind::Instance:
+    return a;
+  case SdfKind::Union:
+    return unite(a, b);
+  case SdfKind::SmoothUnion: {
+    Bound u = unite(a, b);
+    u.radius += 0.25f * abs(static_cast<trm::SmoothUnion *>(node)->radius);
+    return u;
+  }
+  case SdfKind::MultiUnion: {
+    trm::MultiUnion *u = static_cast<trm::MultiUnion *>(node);
+    Bound result = child_bound(*u->nodes[0]);
+    for (std::size_t i = 1; i < u->nodes.size(); ++i)
+      result = unite(result, child_bound(*u->nodes[i]));
+    return result;
+  }
+  case SdfKind::Subtraction:
+  case SdfKind::SmoothSubtraction:
+    return b;
+  case SdfKind::Intersection:
+  case SdfKind::SmoothIntersection:
+    return a.radius / a.scale <= b.radius / b.scale ? a : b;
+  case SdfKind::Plane:
+  case SdfKind::Mandelbox:
+  case SdfKind::Elongate:
+  case SdfKind::Repeat:
+    break;
+  }
+  return {Vec3(0.0f), unbounded, 1.0f};
+}
+
+void bound_nodes(trm::Sdf *node, std::map<trm::Sdf *, bool> *done) {
+  using trm::SdfKind;
+  if (node == nullptr || (*done)[node])
+    return;
+  (*done)[node] = true;
+  for (auto &child : trm::child_slots(node))
+    bound_nodes(child->get(), done);
+  Bound bound = own_bound(node);
+  if (!(bound.radius < unbounded) || !(bound.scale > 0.0f))
+    bound = {Vec3(0.0f), unbounded, 1.0f};
+  // Leaves room for the rounding of the bound and of the node itself.
+  if (bound.radius != unbounded)
+    bound.radius += 1e-4f * (1.0f + abs(bound.radius));
+  node->bound_center = bound.center;
+  node->bound_radius = bound.radius;
+  node->bound_scale = bound.scale;
+  Float lipschitz = node->kind() == SdfKind::Elongate ? 1.0f : 0.0f;
+  for (auto &child : trm::child_slots(node))
+    lipschitz = max(lipschitz, (*child)->lipschitz);
+  if (lipschitz == 0.0f)
+    lipschitz = 1.0f;
+  // Plane normals are not normalized, and scale the value.
+  if (node->kind() == SdfKind::Plane)
+    lipschitz = length(static_cast<trm::Plane *>(node)->norm.xyz());
+  if (node->transformed)
+    lipschitz *= Float(largest_singular(node->inv));
+  node->lipschitz = lipschitz;
+  SdfKind kind = node->kind();
+  node->bound_test = bound.radius != unbounded && kind != SdfKind::Sphere &&
+                     kind != SdfKind::Box && kind != SdfKind::Cylinder &&
+                     kind != SdfKind::Torus;
+  node->lod_scale = unbounded;
+  node->kernel = trm::kernel::entry(kind);
+}
+
+// Lowers the `lod_scale` of `node` and its descendants to what the path
+// reaching it with `scale` gives. Paths that can not lower it end early.
+void scale_nodes(trm::Sdf *node, Float scale) {
+  if (node == nullptr)
+    return;
+  if (node->transformed)
+    scale /= Float(largest_singular(node->trans));
+  if (!(scale < node->lod_scale))
+    return;
+  node->lod_scale = scale;
+  for (auto &child : trm::child_slots(node))
+    scale_nodes(child->get(), scale);
+}
+
+// Value of `node` at the point `q` of its own frame, through the kernel of
+// the node when it has one.
+inline Float local_dist(const trm::Sdf &node, const Vec3 &q) {
+  return node.kernel != nullptr ? node.kernel->dist(node, q) : node.dist(q);
+}
+inline Float local_dist(const trm::Sdf &node, const Vec3 &q, Float cutoff) {
+  return node.kernel != nullptr ? node.kernel->bounded(node, q, cutoff)
+                                : node.dist(q, cutoff);
+}
+} // namespace
+
+thread_local Float trm::lod_footprint = 0.0f;
 
 trm::Sdf::Sdf()
-    : trans(1.0f), inv(1.0f), mat(nullptr), a(nullptr), b(nullptr) {}
+    : trans(1.0f), inv(1.0f), transformed(true), mat(nullptr), a(nullptr),
+      b(nullptr), bound_center(0.0f),
+      bound_radius(std::numeric_limits<Float>::infinity()), bound_scale(1.0f),
+      bound_test(false), lipschitz(1.0f), lod_scale(1.0f), kernel(nullptr),
+      memo(-1), memo_epoch(0) {}
 trm::Sdf::Sdf(const std::shared_ptr<Material> &mat)
-    : trans(1.0f), inv(1.0f), mat(mat), a(nullptr), b(nullptr) {}
+    : trans(1.0f), inv(1.0f), transformed(true), mat(mat), a(nullptr),
+      b(nullptr), bound_center(0.0f),
+      bound_radius(std::numeric_limits<Float>::infinity()), bound_scale(1.0f),
+      bound_test(false), lipschitz(1.0f), lod_scale(1.0f), kernel(nullptr),
+      memo(-1), memo_epoch(0) {}
 trm::Sdf::Sdf(const std::shared_ptr<Sdf> &a, const std::shared_ptr<Sdf> &b)
-    : trans(1.0f), inv(1.0f), mat(nullptr), a(a), b(b) {}
+    : trans(1.0f), inv(1.0f), transformed(true), mat(nullptr), a(a), b(b),
+      bound_center(0.0f),
+      bound_radius(std::numeric_limits<Float>::infinity()), bound_scale(1.0f),
+      bound_test(false), lipschitz(1.0f), lod_scale(1.0f), kernel(nullptr),
+      memo(-1), memo_epoch(0) {}
 trm::Sdf::Sdf(const std::shared_ptr<Material> &mat,
               const std::shared_ptr<Sdf> &a, const std::shared_ptr<Sdf> &b)
-    : trans(1.0f), inv(1.0f), mat(mat), a(a), b(b) {}
+    : trans(1.0f), inv(1.0f), transformed(true), mat(mat), a(a), b(b),
+      bound_center(0.0f),
+      bound_radius(std::numeric_limits<Float>::infinity()), bound_scale(1.0f),
+      bound_test(false), lipschitz(1.0f), lod_scale(1.0f), kernel(nullptr),
+      memo(-1), memo_epoch(0) {}
 
 Float trm::Sdf::operator()(const Vec3 &p) const {
-  return this->dist(Vec3(this->inv * Vec4(p, 1.0f)));
+  if (this->memo < 0)
+    return local_dist(
+        *this, this->transformed ? Vec3(this->inv * Vec4(p, 1.0f)) : p);
+  // Parents with the same transform pass the same point, so the last result
+  // of the slot answers every parent after the first.
+  std::vector<MemoEntry> &cache = memo_cache;
+  std::size_t slot = static_cast<std::size_t>(this->memo);
+  if (slot < cache.size() && cache[slot].epoch == this->memo_epoch &&
+      cache[slot].p == p && cache[slot].footprint == lod_footprint)
+    return cache[slot].d;
+  Float d = local_dist(
+      *this, this->transformed ? Vec3(this->inv * Vec4(p, 1.0f)) : p);
+  // Children may have grown the cache, so it is indexed again.
+  if (slot >= cache.size())
+    cache.resize(slot + 1);
+  cache[slot] = {p, d, lod_footprint, this->memo_epoch};
+  return d;
+}
+Float trm::Sdf::operator()(const Vec3 &p, Float cutoff) const {
+  std::size_t slot = static_cast<std::size_t>(this->memo);
+  if (this->memo >= 0 && slot < memo_cache.size() &&
+      memo_cache[slot].epoch == this->memo_epoch && memo_cache[slot].p == p &&
+      memo_cache[slot].footprint == lod_footprint)
+    return memo_cache[slot].d;
+  Vec3 q = this->transformed ? Vec3(this->inv * Vec4(p, 1.0f)) : p;
+  if (this->bound_test) {
+    Float bound = this->bound_scale * length(q - this->bound_center) -
+                  this->bound_radius;
+    if (bound >= cutoff)
+      return bound;
+  }
+  Float d = local_dist(*this, q, cutoff);
+  // Only values below the cutoff are exact, and only those are memoized.
+  if (this->memo >= 0 && d < cutoff) {
+    if (slot >= memo_cache.size())
+      memo_cache.resize(slot + 1);
+    memo_cache[slot] = {p, d, lod_footprint, this->memo_epoch};
+  }
+  return d;
 }
 Vec3 trm::Sdf::normal(const Vec3 &p, const Float &ep) {
   Vec3 op = this->inv * Vec4(p, 1.0f);
@@ -28,6 +355,152 @@ Vec3 trm::Sdf::normal(const Vec3 &p, const Float &ep) {
                             this->dist(Vec3(op.x, op.y, op.z - ep)),
                         0.0f));
 }
+void trm::enclosing_sphere(const Sdf &node, Vec3 *center, Float *radius) {
+  Bound bound = child_bound(node);
+  *center = bound.center;
+  *radius = bound.radius == unbounded ? unbounded : bound.radius / bound.scale;
+}
+Float trm::orbit_trap(const Sdf &node, const Vec3 &p) {
+  Vec3 q = node.transformed ? Vec3(node.inv * Vec4(p, 1.0f)) : p;
+  switch (node.kind()) {
+  case SdfKind::MengerSponge:
+    return static_cast<const MengerSponge &>(node).trap(q);
+  case SdfKind::SerpinskiTetrahedron:
+    return static_cast<const SerpinskiTetrahedron &>(node).trap(q);
+  case SdfKind::Kifs:
+    return static_cast<const Kifs &>(node).trap(q);
+  case SdfKind::Mandelbulb:
+    return static_cast<const Mandelbulb &>(node).trap(q);
+  case SdfKind::Mandelbox:
+    return static_cast<const Mandelbox &>(node).trap(q);
+  case SdfKind::Round:
+  case SdfKind::Onion:
+  case SdfKind::Instance:
+    return orbit_trap(*node.a, q);
+  case SdfKind::Union:
+  case SdfKind::SmoothUnion:
+    return orbit_trap((*node.a)(q) <= (*node.b)(q) ? *node.a : *node.b, q);
+  case SdfKind::Intersection:
+  case SdfKind::SmoothIntersection:
+    return orbit_trap((*node.a)(q) >= (*node.b)(q) ? *node.a : *node.b, q);
+  case SdfKind::Subtraction:
+  case SdfKind::SmoothSubtraction:
+    return orbit_trap(-(*node.a)(q) >= (*node.b)(q) ? *node.a : *node.b, q);
+  case SdfKind::MultiUnion: {
+    const Sdf *nearest = nullptr;
+    Float d = std::numeric_limits<Float>::infinity();
+    for (auto &child : static_cast<const MultiUnion &>(node).nodes) {
+      Float c = (*child)(q);
+      if (c < d) {
+        d = c;
+        nearest = child.get();
+      }
+    }
+    return nearest != nullptr ? orbit_trap(*nearest, q) : -1.0f;
+  }
+  default:
+    return -1.0f;
+  }
+}
+bool trm::analytic(const Sdf &node) {
+  switch (node.kind()) {
+  case SdfKind::Plane:
+  case SdfKind::Sphere:
+  case SdfKind::Box:
+    return true;
+  default:
+    return false;
+  }
+}
+Float trm::intersect(const Sdf &node, const Vec3 &o, const Vec3 &d,
+                     Float t_min) {
+  const Float none = std::numeric_limits<Float>::infinity();
+  // The surface is the image of the one in the node's frame, so the ray is
+  // taken there without normalizing, which keeps its parameter.
+  Vec3 lo = node.transformed ? Vec3(node.inv * Vec4(o, 1.0f)) : o;
+  Vec3 ld = node.transformed ? Vec3(node.inv * Vec4(d, 0.0f)) : d;
+  switch (node.kind()) {
+  case SdfKind::Plane: {
+    const Vec4 &n = static_cast<const Plane &>(node).norm;
+    Float rate = dot(ld, n.xyz());
+    if (rate == 0.0f)
+      return none;
+    Float t = (n.w - dot(lo, n.xyz())) / rate;
+    return t > t_min ? t : none;
+  }
+  case SdfKind::Sphere: {
+    Float radius = static_cast<const Sphere &>(node).radius;
+    Float a = dot(ld, ld), b = dot(lo, ld), c = dot(lo, lo) - radius * radius;
+    Float disc = b * b - a * c;
+    if (disc < 0.0f)
+      return none;
+    Float root = std::sqrt(disc);
+    if ((-b - root) / a > t_min)
+      return (-b - root) / a;
+    return (-b + root) / a > t_min ? (-b + root) / a : none;
+  }
+  case SdfKind::Box: {
+    const Vec3 &dim = static_cast<const Box &>(node).dim;
+    Float t_near = -none, t_far = none;
+    for (int i = 0; i < 3; ++i) {
+      if (ld[i] == 0.0f) {
+        if (abs(lo[i]) > dim[i])
+          return none;
+        continue;
+      }
+      Float t0 = (-dim[i] - lo[i]) / ld[i], t1 = (dim[i] - lo[i]) / ld[i];
+      t_near = max(t_near, min(t0, t1));
+      t_far = min(t_far, max(t0, t1));
+    }
+    if (t_near > t_far)
+      return none;
+    if (t_near > t_min)
+      return t_near;
+    return t_far > t_min ? t_far : none;
+  }
+  default:
+    return none;
+  }
+}
+Float trm::Sdf::lipschitz_along(const Vec3 &d) const {
+  if (!this->transformed)
+    return min(this->local_lipschitz_along(d), this->lipschitz);
+  // The linear part of `inv` maps `d` onto a direction in the node's frame,
+  // stretched by the length of the result.
+  Vec3 local = Vec3(this->inv * Vec4(d, 0.0f));
+  Float stretch = length(local);
+  if (stretch == 0.0f)
+    return 0.0f;
+  return min(this->local_lipschitz_along(local / stretch) * stretch,
+             this->lipschitz);
+}
+Float trm::Sdf::local_lipschitz_along(const Vec3 &d) const {
+  Float rate = 0.0f;
+  bool leaf = true;
+  for (auto &child : child_slots(const_cast<Sdf *>(this))) {
+    rate = max(rate, (*child)->lipschitz_along(d));
+    leaf = false;
+  }
+  return leaf ? 1.0f : rate;
+}
+Float trm::Sdf::rate_from(const Vec3 &p, const Vec3 &d) const {
+  if (!this->transformed)
+    return min(this->local_rate_from(p, d), this->lipschitz);
+  Vec3 local = Vec3(this->inv * Vec4(d, 0.0f));
+  Float stretch = length(local);
+  if (stretch == 0.0f)
+    return 0.0f;
+  return min(this->local_rate_from(Vec3(this->inv * Vec4(p, 1.0f)),
+                                   local / stretch) *
+                 stretch,
+             this->lipschitz);
+}
+Float trm::Sdf::children_rate_from(const Vec3 &p, const Vec3 &d) const {
+  Float rate = 0.0f;
+  for (auto &child : child_slots(const_cast<Sdf *>(this)))
+    rate = max(rate, (*child)->rate_from(p, d));
+  return rate;
+}
 std::shared_ptr<trm::Sdf> trm::Sdf::translate(const Vec3 &xyz) {
   this->trans = glm::translate(this->trans, xyz);
   this->inv = glm::translate(this->inv, -xyz);
@@ -45,3 +518,133 @@ std::shared_ptr<trm::Sdf> trm::Sdf::scale(const Vec3 &xyz) {
   this->inv = glm::scale(this->inv, 1.0f / xyz);
   return shared_from_this();
 }
+
+std::vector<std::shared_ptr<trm::Sdf> *> trm::child_slots(Sdf *node) {
+  std::vector<std::shared_ptr<Sdf> *> slots;
+  if (node->a != nullptr)
+    slots.push_back(&node->a);
+  if (node->b != nullptr)
+    slots.push_back(&node->b);
+  if (node->kind() == SdfKind::MultiUnion) {
+    for (auto &child : static_cast<MultiUnion *>(node)->nodes)
+      slots.push_back(&child);
+  }
+  return slots;
+}
+
+std::vector<Float> trm::node_params(const Sdf &node) {
+  switch (node.kind()) {
+  case SdfKind::Sphere:
+    return {static_cast<const Sphere &>(node).radius};
+  case SdfKind::Box: {
+    const Vec3 &dim = static_cast<const Box &>(node).dim;
+    return {dim.x, dim.y, dim.z};
+  }
+  case SdfKind::Cylinder: {
+    const Cylinder &c = static_cast<const Cylinder &>(node);
+    return {c.height, c.radius};
+  }
+  case SdfKind::Torus: {
+    const Vec2 &t = static_cast<const Torus &>(node).torus;
+    return {t.x, t.y};
+  }
+  case SdfKind::Plane: {
+    const Vec4 &n = static_cast<const Plane &>(node).norm;
+    return {n.x, n.y, n.z, n.w};
+  }
+  case SdfKind::Pyramid:
+    return {static_cast<const Pyramid &>(node).height};
+  case SdfKind::MengerSponge:
+    return {Float(static_cast<const MengerSponge &>(node).iterations)};
+  case SdfKind::SerpinskiTetrahedron:
+    return {Float(static_cast<const SerpinskiTetrahedron &>(node).iterations)};
+  case SdfKind::Kifs: {
+    const Kifs &k = static_cast<const Kifs &>(node);
+    return {Float(k.iterations), Float(k.symmetry), k.factor,
+            k.offset.x,          k.offset.y,        k.offset.z,
+            k.angles.x,          k.angles.y,        k.angles.z};
+  }
+  case SdfKind::Mandelbulb: {
+    const Mandelbulb &m = static_cast<const Mandelbulb &>(node);
+    return {Float(m.iterations), m.power};
+  }
+  case SdfKind::Mandelbox: {
+    const Mandelbox &m = static_cast<const Mandelbox &>(node);
+    return {Float(m.iterations), m.factor, m.min_radius, m.fixed_radius,
+            m.limit};
+  }
+  case SdfKind::Elongate: {
+    const Vec3 &h = static_cast<const Elongate &>(node).h;
+    return {h.x, h.y, h.z};
+  }
+  case SdfKind::Round:
+    return {static_cast<const Round &>(node).radius};
+  case SdfKind::Onion:
+    return {static_cast<const Onion &>(node).thickness};
+  case SdfKind::Repeat: {
+    const Vec3 &period = static_cast<const Repeat &>(node).period;
+    return {period.x, period.y, period.z};
+  }
+  case SdfKind::LimitedRepeat: {
+    const LimitedRepeat &r = static_cast<const LimitedRepeat &>(node);
+    return {r.period.x, r.period.y, r.period.z,
+            r.limit.x,  r.limit.y,  r.limit.z};
+  }
+  case SdfKind::Mirror: {
+    const Vec3 &axes = static_cast<const Mirror &>(node).axes;
+    return {axes.x, axes.y, axes.z};
+  }
+  case SdfKind::PolarRepeat:
+    return {Float(static_cast<const PolarRepeat &>(node).count)};
+  case SdfKind::SmoothUnion:
+    return {static_cast<const SmoothUnion &>(node).radius};
+  case SdfKind::SmoothSubtraction:
+    return {static_cast<const SmoothSubtraction &>(node).radius};
+  case SdfKind::SmoothIntersection:
+    return {static_cast<const SmoothIntersection &>(node).radius};
+  case SdfKind::Instance:
+  case SdfKind::MultiUnion:
+  case SdfKind::Union:
+  case SdfKind::Subtraction:
+  case SdfKind::Intersection:
+    break;
+  }
+  return {};
+}
+
+std::size_t
+trm::memoize_shared(const std::vector<std::shared_ptr<Sdf>> &objects) {
+  std::map<Sdf *, int> paths;
+  for (auto &obj : objects) {
+    if (obj->mat != nullptr)
+      count_paths(obj.get(), &paths);
+  }
+  uint32_t epoch = next_epoch++;
+  int32_t slots = 0;
+  for (auto &node : paths) {
+    node.first->memo = node.second > 1 ? slots++ : -1;
+    node.first->memo_epoch = epoch;
+  }
+  return static_cast<std::size_t>(slots);
+}
+
+std::size_t trm::merge_identical(std::vector<std::shared_ptr<Sdf>> *objects) {
+  std::map<const Sdf *, std::shared_ptr<Sdf>> done;
+  std::unordered_map<std::string, std::shared_ptr<Sdf>> unique;
+  for (auto &obj : *objects) {
+    for (auto &child : child_slots(obj.get()))
+      *child = canonical(*child, &done, &unique);
+  }
+  std::size_t merged = 0;
+  for (auto &node : done)
+    merged += node.first != node.second.get();
+  return merged;
+}
+
+void trm::compute_bounds(const std::vector<std::shared_ptr<Sdf>> &objects) {
+  std::map<Sdf *, bool> done;
+  for (auto &obj : objects)
+    bound_nodes(obj.get(), &done);
+  for (auto &obj : objects)
+    scale_nodes(obj.get(), 1.0f);
+}
@@ -3,14 +3,58 @@
 
 #include "type.hpp"
 
+#include <cmath>
+#include <cstdint>
 #include <limits>
 #include <map>
 #include <memory>
+#include <vector>
 
+#include "approx.hpp"
+#include "fractal.hpp"
 #include "interp.hpp"
 #include "material.hpp"
 
 namespace trm {
+enum class SdfKind {
+  Sphere,
+  Box,
+  Cylinder,
+  Torus,
+  Plane,
+  Pyramid,
+  MengerSponge,
+  SerpinskiTetrahedron,
+  Kifs,
+  Mandelbulb,
+  Mandelbox,
+  Elongate,
+  Round,
+  Onion,
+  Union,
+  Subtraction,
+  Intersection,
+  SmoothUnion,
+  SmoothSubtraction,
+  SmoothIntersection,
+  Repeat,
+  LimitedRepeat,
+  Mirror,
+  PolarRepeat,
+  Instance,
+  MultiUnion
+};
+
+// Radius of the ray footprint around the points the calling thread is
+// evaluating, in the frame of the scene objects, or 0 where detail of every
+// size matters. Fractals built from folds skip the iterations whose detail
+// is smaller.
+extern thread_local Float lod_footprint;
+
+namespace kernel {
+  struct Entry;
+} // namespace kernel
+
 struct Sdf : std::enable_shared_from_this<Sdf> {
   Sdf();
   Sdf(const std::shared_ptr<Material> &mat);
@@ -20,20 +64,113 @@ struct Sdf : std::enable_shared_from_this<Sdf> {
   virtual ~Sdf() {}
 
   Float operator()(const Vec3 &p) const;
+  // Same as operator(), except that values of at least `cutoff` may come back
+  // as any other value of at least `cutoff`. Callers that only need to know
+  // whether the node is closer than `cutoff` let nodes skip the rest of their
+  // work this way: the bounding sphere, remaining fractal iterations or the
+  // second child of an intersection.
+  Float operator()(const Vec3 &p, Float cutoff) const;
   Vec3 normal(const Vec3 &p,
               const Float &ep = 10 * std::numeric_limits<Float>::epsilon());
   std::shared_ptr<Sdf> translate(const Vec3 &xyz);
   std::shared_ptr<Sdf> rotate(const Float &angle, const Vec3 &axis);
   std::shared_ptr<Sdf> scale(const Vec3 &xyz);
+  // Bound on the rate of change of the value along the unit direction `d` in
+  // the parent's frame, which holds over any segment in that direction and
+  // is at most `lipschitz`.
+  Float lipschitz_along(const Vec3 &d) const;
+  // Bound on how fast the value can fall along the unit direction `d` in the
+  // parent's frame, anywhere on the ray from the point `p` on. Unlike
+  // `lipschitz_along` it depends on where the ray is, and drops to 0 once
+  // the ray has passed a convex node.
+  Float rate_from(const Vec3 &p, const Vec3 &d) const;
 
   inline virtual Float dist(const Vec3 &) const = 0;
+  // Bounded version of `dist`, see the bounded operator().
+  virtual Float dist(const Vec3 &p, Float) const { return dist(p); }
+  // `lipschitz_along` in the node's own frame. Defaults to the largest of
+  // the children, or 1 for leaves.
+  virtual Float local_lipschitz_along(const Vec3 &d) const;
+  // `rate_from` in the node's own frame. Defaults to `local_lipschitz_along`.
+  virtual Float local_rate_from(const Vec3 &, const Vec3 &d) const {
+    return local_lipschitz_along(d);
+  }
+  // Largest `rate_from` of the children, for nodes that evaluate them all at
+  // their own point and fall no faster than the fastest of them.
+  Float children_rate_from(const Vec3 &p, const Vec3 &d) const;
+  // Shallow copy of the node, children are shared with the original.
+  virtual std::shared_ptr<Sdf> clone() const = 0;
+  virtual SdfKind kind() const = 0;
 
   Mat4 trans, inv;
+  // Cleared by the optimizer when `inv` is the identity, so evaluation skips
+  // the matrix product.
+  bool transformed;
 
   std::shared_ptr<Material> mat;
   std::shared_ptr<trm::Sdf> a, b;
+
+  // The node's value is at least `bound_scale * length(p - bound_center) -
+  // bound_radius` at every local point p, infinite radii meaning unbounded.
+  // `bound_test` is set where testing that is cheaper than the node.
+  Vec3 bound_center;
+  Float bound_radius, bound_scale;
+  bool bound_test;
+  // How much the value can change per unit of distance in the parent's frame,
+  // which is above 1 where transforms shrink space along some axis.
+  Float lipschitz;
+  // Smallest factor by which lengths in the frame of the scene objects grow
+  // in the node's frame, over every path from an object to the node.
+  Float lod_scale;
+  // `dist` of the node's kind compiled for the instruction set selected when
+  // the node was bound, or null to call `dist` itself.
+  const kernel::Entry *kernel;
+
+  // Slot in the per-thread memo cache for nodes evaluated by several parents,
+  // -1 for the rest. Slots are only valid together with their epoch, which
+  // is unique to every call of `memoize_shared`.
+  int32_t memo;
+  uint32_t memo_epoch;
 };
 
+// Slots of every child of the node: `a`, `b` when set and the operands of
+// n-ary nodes.
+std::vector<std::shared_ptr<Sdf> *> child_slots(Sdf *node);
+// Derives the bounding spheres, Lipschitz constants and LOD scales of every
+// node reachable from `objects`, and gives them the kernels of the selected
+// instruction set.
+void compute_bounds(const std::vector<std::shared_ptr<Sdf>> &objects);
+// Sphere in the parent's frame that contains the surface and interior of the
+// node, with an infinite radius for unbounded nodes.
+void enclosing_sphere(const Sdf &node, Vec3 *center, Float *radius);
+// Square root of the smallest squared length the orbit of `p` reaches in the
+// fractal whose surface is nearest to `p`, following transforms, unions and
+// the other operators that leave the point alone, or -1 if there is none.
+Float orbit_trap(const Sdf &node, const Vec3 &p);
+// Whether rays can be intersected with the node in closed form: planes,
+// spheres and boxes, under any affine transform.
+bool analytic(const Sdf &node);
+// Nearest parameter above `t_min` at which the ray from `o` along `d` meets
+// the surface of an `analytic` node, or infinity if it does not.
+Float intersect(const Sdf &node, const Vec3 &o, const Vec3 &d, Float t_min);
+// Own parameters of the node in declaration order, without its children,
+// transform or material.
+std::vector<Float> node_params(const Sdf &node);
+// Points every child at one representative of the structurally identical
+// subtrees (same kinds, parameters, transforms and materials) it belongs to.
+// Scene objects themselves are kept. Returns the number of nodes merged away.
+std::size_t merge_identical(std::vector<std::shared_ptr<Sdf>> *objects);
+// Gives every node that more than one path from the evaluated objects (those
+// with a material) reaches its own memo slot, so it is evaluated once per
+// query point however many parents it has. Returns the number of slots.
+std::size_t memoize_shared(const std::vector<std::shared_ptr<Sdf>> &objects);
+
+#define SDF_NODE(TYPE)                                                         \
+  using Sdf::dist;                                                             \
+  std::shared_ptr<Sdf> clone() const override {                                \
+    return std::make_shared<TYPE>(*this);                                      \
+  }                                                                            \
+  SdfKind kind() const override { return SdfKind::TYPE; }
 #define SDF_GEN(TYPE)                                                          \
   template <typename... Args>                                                  \
   std::shared_ptr<Sdf> sdf##TYPE(const Args &... args) {                       \
@@ -45,7 +182,13 @@ struct Sphere : Sdf {
   Sphere(const Float &radius, const Args &... args)
       : Sdf(args...), radius(radius) {}
   inline Float dist(const Vec3 &p) const override { return length(p) - radius; }
+  // Convex nodes fall no faster ahead of `p` than they do at `p`.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    Float r = length(p);
+    return r > 0.0f ? max(-dot(p, d), 0.0f) / r : 1.0f;
+  }
   Float radius;
+  SDF_NODE(Sphere)
 };
 struct Box : Sdf {
   template <typename... Args>
@@ -57,7 +200,22 @@ struct Box : Sdf {
     Vec3 q = abs(p) - dim;
     return length(max(q, 0.0f)) + min(max(q.x, max(q.y, q.z)), 0.0f);
   }
+  // Convex, with the gradient pointing to the closest point outside and along
+  // the axis of the closest face inside.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    Vec3 q = abs(p) - dim, g(0.0f);
+    if (max(q.x, max(q.y, q.z)) > 0.0f)
+      g = normalize(max(q, 0.0f));
+    else if (q.x >= q.y && q.x >= q.z)
+      g.x = 1.0f;
+    else if (q.y >= q.z)
+      g.y = 1.0f;
+    else
+      g.z = 1.0f;
+    return max(-dot(g * sign(p), d), 0.0f);
+  }
   Vec3 dim;
+  SDF_NODE(Box)
 };
 struct Cylinder : Sdf {
   template <typename... Args>
@@ -67,7 +225,23 @@ struct Cylinder : Sdf {
     Vec2 d = abs(Vec2(length(p.xz()), p.y)) - Vec2(radius, height);
     return min(max(d.x, d.y), 0.0f) + length(max(d, 0.0f));
   }
+  // Convex, with the gradient split between the radial and the axial
+  // direction like that of a box.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    Float r = length(p.xz());
+    Vec2 q = Vec2(r, abs(p.y)) - Vec2(radius, height), g(0.0f);
+    if (max(q.x, q.y) > 0.0f)
+      g = normalize(max(q, 0.0f));
+    else if (q.x >= q.y)
+      g.x = 1.0f;
+    else
+      g.y = 1.0f;
+    Vec3 radial = r > 0.0f ? Vec3(p.x, 0.0f, p.z) / r : Vec3(0.0f);
+    return max(-dot(g.x * radial + Vec3(0.0f, g.y * sign(p.y), 0.0f), d),
+               0.0f);
+  }
   Float height, radius;
+  SDF_NODE(Cylinder)
 };
 struct Torus : Sdf {
   template <typename... Args>
@@ -79,7 +253,16 @@ struct Torus : Sdf {
     Vec2 q = Vec2(length(p.xz()) - torus.x, p.y);
     return length(q) - torus.y;
   }
+  // Beyond the ring and moving away from the axis, the distance from the
+  // axis only grows further, so the value falls no faster than the height
+  // changes.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    if (length(p.xz()) >= torus.x && dot(p.xz(), d.xz()) >= 0.0f)
+      return abs(d.y);
+    return 1.0f;
+  }
   Vec2 torus;
+  SDF_NODE(Torus)
 };
 struct Plane : Sdf {
   template <typename... Args>
@@ -92,7 +275,14 @@ struct Plane : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return dot(p, norm.xyz()) - norm.w;
   }
+  inline Float local_lipschitz_along(const Vec3 &d) const override {
+    return abs(dot(d, norm.xyz()));
+  }
+  inline Float local_rate_from(const Vec3 &, const Vec3 &d) const override {
+    return max(-dot(d, norm.xyz()), 0.0f);
+  }
   Vec4 norm;
+  SDF_NODE(Plane)
 };
 struct Pyramid : Sdf {
   template <typename... Args>
@@ -121,6 +311,7 @@ struct Pyramid : Sdf {
     return sqrt((d2 + q.z * q.z) / m2) * sign(max(q.z, -p1.y));
   }
   Float height;
+  SDF_NODE(Pyramid)
 };
 
 struct MengerSponge : Sdf {
@@ -128,53 +319,192 @@ struct MengerSponge : Sdf {
   MengerSponge(const std::size_t i, const Args &... args)
       : Sdf(args...), iterations(i) {}
   inline Float dist(const Vec3 &p) const override {
+    return dist(p, std::numeric_limits<Float>::infinity());
+  }
+  // Every iteration only carves away more, so the distance never decreases
+  // and the iterations left can be skipped once it reaches the cutoff, or
+  // once the holes they carve are narrower than the footprint. Points start
+  // one unit off so that tiling centers the cells on the sponge's.
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    fractal::State s(p + 1.0f);
     Vec3 q = abs(p) - Vec3(1.0f);
-    Float d = length(max(q, 0.0f)) + min(max(q.x, max(q.y, q.z)), 0.0f);
-    Float s = 1.0f;
-    for (std::size_t i = 0; i < this->iterations; ++i) {
-      Vec3 a = mod(p * s, 2.0f) - 1.0f;
-      s *= 3.0f;
-      Vec3 r = abs(1.0f - 3.0f * abs(a));
-      Float da = max(r.x, r.y);
-      Float db = max(r.y, r.z);
-      Float dc = max(r.z, r.x);
-      Float c = (min(da, min(db, dc)) - 1.0f) / s;
-
-      d = max(d, c);
-    }
-    return d;
+    s.d = length(max(q, 0.0f)) + min(max(q.x, max(q.y, q.z)), 0.0f);
+    fractal::iterate<false, false>(step(), &s, this->iterations, 1.0f / 3.0f,
+                                   lod_footprint * this->lod_scale, cutoff);
+    return s.d;
+  }
+  inline Float trap(const Vec3 &p) const {
+    fractal::State s(p + 1.0f);
+    fractal::iterate<true, false>(step(), &s, this->iterations, 1.0f / 3.0f,
+                                  lod_footprint * this->lod_scale);
+    return sqrt(s.trap);
+  }
+  static inline fractal::Chain<fractal::Tile, fractal::Scale,
+                               fractal::CrossCarve>
+  step() {
+    return fractal::chain(fractal::Tile(), fractal::Scale(3.0f),
+                          fractal::CrossCarve());
   }
   std::size_t iterations;
+  SDF_NODE(MengerSponge)
 };
 struct SerpinskiTetrahedron : Sdf {
   template <typename... Args>
   SerpinskiTetrahedron(const std::size_t i, const Args &... args)
       : Sdf(args...), iterations(i) {}
+  // Every level lies within the circumsphere of the tetrahedron it folds
+  // into, so iterations stop once that is smaller than the footprint, and
+  // the radius left to the last level is taken off the value to keep it
+  // below the full one.
+  inline Float dist(const Vec3 &p) const override {
+    const Float sqrt3 = 1.7320508f;
+    fractal::State s(p);
+    std::size_t i = fractal::iterate<false, false>(
+        step(), &s, this->iterations, sqrt3, lod_footprint * this->lod_scale);
+    if (i < this->iterations)
+      return (length(s.z) - sqrt3) / s.dr +
+             std::ldexp(sqrt3, -static_cast<int>(this->iterations));
+    return length(s.z) / s.dr;
+  }
+  inline Float trap(const Vec3 &p) const {
+    fractal::State s(p);
+    fractal::iterate<true, false>(step(), &s, this->iterations, 1.7320508f,
+                                  lod_footprint * this->lod_scale);
+    return sqrt(s.trap);
+  }
+  static inline fractal::Chain<fractal::TetraFold, fractal::ScaleOffset>
+  step() {
+    return fractal::chain(fractal::TetraFold(),
+                          fractal::ScaleOffset(2.0f, Vec3(1.0f)));
+  }
+  std::size_t iterations;
+  SDF_NODE(SerpinskiTetrahedron)
+};
+// Kaleidoscopic IFS: every iteration folds space by the symmetry group,
+// rotates it and scales it by `factor` about `offset`. With a factor above
+// 1 the fractal lies within |offset| of the origin, which bounds what the
+// iterations skipped for the footprint can add, as for the tetrahedron.
+struct Kifs : Sdf {
+  enum Symmetry { TETRAHEDRAL, OCTAHEDRAL };
+  template <typename... Args>
+  Kifs(const std::size_t i, const Symmetry &symmetry, const Float &factor,
+       const Vec3 &offset, const Vec3 &angles, const Args &... args)
+      : Sdf(args...), iterations(i), symmetry(symmetry), factor(factor),
+        offset(offset), angles(angles), rotation(rotation_of(angles)),
+        rotated(angles != Vec3(0.0f)) {}
   inline Float dist(const Vec3 &p) const override {
-    Vec3 q = p;
-    std::size_t i = 0;
-    while (i < this->iterations) {
-      if (q.x + q.y < 0) {
-        Float tmp = -q.x;
-        q.x = -q.y;
-        q.y = tmp;
-      }
-      if (q.x + q.z < 0) {
-        Float tmp = -q.x;
-        q.x = -q.z;
-        q.z = tmp;
-      }
-      if (q.y + q.z < 0) {
-        Float tmp = -q.y;
-        q.y = -q.z;
-        q.z = tmp;
-      }
-      q = q * 2.0f - Vec3(1.0f);
-      i++;
-    }
-    return (length(q)) * pow(2.0f, -Float(i));
+    fractal::State s(p);
+    std::size_t i = run<false>(&s);
+    Float radius = length(offset);
+    if (i < this->iterations)
+      return (length(s.z) - radius) / s.dr +
+             radius * pow(abs(factor), -Float(this->iterations));
+    return length(s.z) / s.dr;
+  }
+  inline Float trap(const Vec3 &p) const {
+    fractal::State s(p);
+    run<true>(&s);
+    return sqrt(s.trap);
+  }
+  // Iterates with the chain of operations specialized for the symmetry and
+  // for whether there is a rotation at all.
+  template <bool Trap> inline std::size_t run(fractal::State *s) const {
+    using namespace fractal;
+    Float footprint = lod_footprint * this->lod_scale;
+    Float radius = length(offset);
+    ScaleOffset scale(factor, offset);
+    if (symmetry == TETRAHEDRAL && rotated)
+      return iterate<Trap, false>(chain(TetraFold(), rotation, scale), s,
+                                  this->iterations, radius, footprint);
+    if (symmetry == TETRAHEDRAL)
+      return iterate<Trap, false>(chain(TetraFold(), scale), s,
+                                  this->iterations, radius, footprint);
+    if (rotated)
+      return iterate<Trap, false>(
+          chain(AbsFold(), SortFold(), rotation, scale), s, this->iterations,
+          radius, footprint);
+    return iterate<Trap, false>(chain(AbsFold(), SortFold(), scale), s,
+                                this->iterations, radius, footprint);
+  }
+  static fractal::Rotate rotation_of(const Vec3 &angles) {
+    Mat4 m = glm::rotate(Mat4(1.0f), angles.x, Vec3(1.0f, 0.0f, 0.0f));
+    m = glm::rotate(m, angles.y, Vec3(0.0f, 1.0f, 0.0f));
+    m = glm::rotate(m, angles.z, Vec3(0.0f, 0.0f, 1.0f));
+    return fractal::Rotate(Vec3(m[0]), Vec3(m[1]), Vec3(m[2]));
   }
   std::size_t iterations;
+  Symmetry symmetry;
+  Float factor;
+  Vec3 offset, angles;
+  fractal::Rotate rotation;
+  bool rotated;
+  SDF_NODE(Kifs)
+};
+// Power `power` Mandelbulb, with the usual escape time distance estimate.
+// Escape time estimates grow when fewer iterations leave `dr` smaller, so
+// these fractals run every iteration whatever the footprint.
+struct Mandelbulb : Sdf {
+  template <typename... Args>
+  Mandelbulb(const std::size_t i, const Float &power, const Args &... args)
+      : Sdf(args...), iterations(i), power(power) {}
+  inline Float dist(const Vec3 &p) const override {
+    return eval<approx::Exact>(p);
+  }
+  // `dist` with the angles of the iterations taken through `Math`.
+  template <typename Math> inline Float eval(const Vec3 &p) const {
+    fractal::State s(p);
+    run<false, Math>(&s);
+    Float r = length(s.z);
+    return r > 0.0f ? 0.5f * std::log(r) * r / s.dr : 0.0f;
+  }
+  inline Float trap(const Vec3 &p) const {
+    fractal::State s(p);
+    run<true, approx::Exact>(&s);
+    return sqrt(s.trap);
+  }
+  template <bool Trap, typename Math>
+  inline std::size_t run(fractal::State *s) const {
+    using namespace fractal;
+    return iterate<Trap, true>(chain(Power<Math>(power)), s, this->iterations,
+                               1.0f, 0.0f,
+                               std::numeric_limits<Float>::infinity(), 4.0f);
+  }
+  std::size_t iterations;
+  Float power;
+  SDF_NODE(Mandelbulb)
+};
+// Mandelbox of scale `factor`: box fold at `limit`, sphere fold between the
+// radii `min_radius` and `fixed_radius`, then z * factor + c. Like the
+// Mandelbulb, it runs every iteration.
+struct Mandelbox : Sdf {
+  template <typename... Args>
+  Mandelbox(const std::size_t i, const Float &factor, const Float &min_radius,
+            const Float &fixed_radius, const Float &limit,
+            const Args &... args)
+      : Sdf(args...), iterations(i), factor(factor), min_radius(min_radius),
+        fixed_radius(fixed_radius), limit(limit) {}
+  inline Float dist(const Vec3 &p) const override {
+    fractal::State s(p);
+    run<false>(&s);
+    return length(s.z) / abs(s.dr);
+  }
+  inline Float trap(const Vec3 &p) const {
+    fractal::State s(p);
+    run<true>(&s);
+    return sqrt(s.trap);
+  }
+  template <bool Trap> inline std::size_t run(fractal::State *s) const {
+    using namespace fractal;
+    return iterate<Trap, true>(
+        chain(BoxFold(limit),
+              SphereFold(min_radius * min_radius, fixed_radius * fixed_radius),
+              ScaleAdd(factor)),
+        s, this->iterations, 1.0f, 0.0f,
+        std::numeric_limits<Float>::infinity(), 1e4f);
+  }
+  std::size_t iterations;
+  Float factor, min_radius, fixed_radius, limit;
+  SDF_NODE(Mandelbox)
 };
 
 struct Elongate : Sdf {
@@ -185,7 +515,18 @@ struct Elongate : Sdf {
     Vec3 q = abs(p) - h;
     return (*this->a)(max(q, 0.0f)) + min(max(q.x, max(q.y, q.z)), 0.0f);
   }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    Vec3 q = abs(p) - h;
+    Float inside = min(max(q.x, max(q.y, q.z)), 0.0f);
+    return (*this->a)(max(q, 0.0f), cutoff - inside) + inside;
+  }
+  // The folded point turns with `d` at the faces, and the inside term changes
+  // at rate 1.
+  inline Float local_lipschitz_along(const Vec3 &) const override {
+    return max(this->a->lipschitz, Float(1.0f));
+  }
   Vec3 h;
+  SDF_NODE(Elongate)
 };
 struct Round : Sdf {
   template <typename... Args>
@@ -195,7 +536,14 @@ struct Round : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return (*this->a)(p)-radius;
   }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return (*this->a)(p, cutoff + radius) - radius;
+  }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
   Float radius;
+  SDF_NODE(Round)
 };
 struct Onion : Sdf {
   template <typename... Args>
@@ -205,7 +553,125 @@ struct Onion : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return abs((*this->a)(p)) - thickness;
   }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return abs((*this->a)(p, cutoff + thickness)) - thickness;
+  }
   Float thickness;
+  SDF_NODE(Onion)
+};
+
+// Domain operators fold space before evaluating their child, so one node
+// stands for many copies at the cost of a single evaluation. The child must
+// fit inside one cell (or sector) for the distance to stay a bound.
+
+// Infinite repetition with cells `period` apart, centered on the origin. A
+// period of 0 leaves that axis unrepeated.
+struct Repeat : Sdf {
+  template <typename... Args>
+  Repeat(const std::shared_ptr<Sdf> &a, const Vec3 &period,
+         const Args &... args)
+      : Sdf(args..., a), period(period),
+        inv_period(period.x != 0.0f ? 1.0f / period.x : 0.0f,
+                   period.y != 0.0f ? 1.0f / period.y : 0.0f,
+                   period.z != 0.0f ? 1.0f / period.z : 0.0f) {}
+  inline Float dist(const Vec3 &p) const override {
+    return (*this->a)(p - period * round(p * inv_period));
+  }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return (*this->a)(p - period * round(p * inv_period), cutoff);
+  }
+  Vec3 period, inv_period;
+  SDF_NODE(Repeat)
+};
+// Repetition limited to cells -limit to limit along each axis.
+struct LimitedRepeat : Sdf {
+  template <typename... Args>
+  LimitedRepeat(const std::shared_ptr<Sdf> &a, const Vec3 &period,
+                const Vec3 &limit, const Args &... args)
+      : Sdf(args..., a), period(period),
+        inv_period(period.x != 0.0f ? 1.0f / period.x : 0.0f,
+                   period.y != 0.0f ? 1.0f / period.y : 0.0f,
+                   period.z != 0.0f ? 1.0f / period.z : 0.0f),
+        limit(limit) {}
+  inline Float dist(const Vec3 &p) const override {
+    return (*this->a)(p - period * clamp(round(p * inv_period), -limit, limit));
+  }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return (*this->a)(p - period * clamp(round(p * inv_period), -limit, limit),
+                      cutoff);
+  }
+  Vec3 period, inv_period, limit;
+  SDF_NODE(LimitedRepeat)
+};
+// Mirrors the positive side of every axis whose `axes` component is 1 onto the
+// negative side.
+struct Mirror : Sdf {
+  template <typename... Args>
+  Mirror(const std::shared_ptr<Sdf> &a, const Vec3 &axes,
+         const Args &... args)
+      : Sdf(args..., a), axes(axes) {}
+  inline Float dist(const Vec3 &p) const override {
+    return (*this->a)(p + axes * (abs(p) - p));
+  }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return (*this->a)(p + axes * (abs(p) - p), cutoff);
+  }
+  inline Float local_lipschitz_along(const Vec3 &) const override {
+    return this->a->lipschitz;
+  }
+  Vec3 axes;
+  SDF_NODE(Mirror)
+};
+// `count` copies around the y axis, the child being the one centered on +x.
+struct PolarRepeat : Sdf {
+  template <typename... Args>
+  PolarRepeat(const std::shared_ptr<Sdf> &a, const std::size_t count,
+              const Args &... args)
+      : Sdf(args..., a), count(count),
+        sector(2.0f * Float(M_PI) / Float(count)) {}
+  inline Float dist(const Vec3 &p) const override {
+    return eval<approx::Exact>(p);
+  }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return eval<approx::Exact>(p, cutoff);
+  }
+  // `dist` with the angle of the fold taken through `Math`.
+  template <typename Math> inline Float eval(const Vec3 &p) const {
+    return (*this->a)(fold<Math>(p));
+  }
+  template <typename Math>
+  inline Float eval(const Vec3 &p, Float cutoff) const {
+    return (*this->a)(fold<Math>(p), cutoff);
+  }
+  inline Float local_lipschitz_along(const Vec3 &) const override {
+    return this->a->lipschitz;
+  }
+  template <typename Math> inline Vec3 fold(const Vec3 &p) const {
+    Float angle = Math::atan2(p.z, p.x) + 0.5f * sector;
+    angle = angle - sector * std::floor(angle / sector) - 0.5f * sector;
+    Float r = length(p.xz());
+    Float s, c;
+    Math::sincos(angle, &s, &c);
+    return Vec3(r * c, p.y, r * s);
+  }
+  std::size_t count;
+  Float sector;
+  SDF_NODE(PolarRepeat)
+};
+// Places a shared subtree with the instance's own transform and material,
+// without copying the subtree.
+struct Instance : Sdf {
+  template <typename... Args>
+  Instance(const std::shared_ptr<Sdf> &a, const Args &... args)
+      : Sdf(args..., a) {}
+  inline Float dist(const Vec3 &p) const override { return (*this->a)(p); }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    return (*this->a)(p, cutoff);
+  }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
+  SDF_NODE(Instance)
 };
 
 struct Union : Sdf {
@@ -216,6 +682,40 @@ struct Union : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return min((*this->a)(p), (*this->b)(p));
   }
+  // The second child only has to be exact below the first.
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    Float d = (*this->a)(p, cutoff);
+    return min(d, (*this->b)(p, min(d, cutoff)));
+  }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
+  SDF_NODE(Union)
+};
+// Minimum of any number of operands, which the optimizer builds from chains
+// of unions. `a` and `b` are unused.
+struct MultiUnion : Sdf {
+  template <typename... Args>
+  MultiUnion(const std::vector<std::shared_ptr<Sdf>> &nodes,
+             const Args &... args)
+      : Sdf(args...), nodes(nodes) {}
+  inline Float dist(const Vec3 &p) const override {
+    Float d = std::numeric_limits<Float>::infinity();
+    for (auto &node : nodes)
+      d = min(d, (*node)(p));
+    return d;
+  }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    Float d = std::numeric_limits<Float>::infinity();
+    for (auto &node : nodes)
+      d = min(d, (*node)(p, min(d, cutoff)));
+    return d;
+  }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
+  std::vector<std::shared_ptr<Sdf>> nodes;
+  SDF_NODE(MultiUnion)
 };
 struct Subtraction : Sdf {
   template <typename... Args>
@@ -225,6 +725,17 @@ struct Subtraction : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return max(-(*this->a)(p), (*this->b)(p));
   }
+  // Only the subtrahend has to be exact, so the other side goes first.
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    Float d = (*this->b)(p, cutoff);
+    return d >= cutoff ? d : max(-(*this->a)(p), d);
+  }
+  // The subtracted child falls where `a` grows, which only its directional
+  // bound limits.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return max(this->a->lipschitz_along(d), this->b->rate_from(p, d));
+  }
+  SDF_NODE(Subtraction)
 };
 struct Intersection : Sdf {
   template <typename... Args>
@@ -234,6 +745,14 @@ struct Intersection : Sdf {
   inline Float dist(const Vec3 &p) const override {
     return max((*this->a)(p), (*this->b)(p));
   }
+  inline Float dist(const Vec3 &p, Float cutoff) const override {
+    Float d = (*this->a)(p, cutoff);
+    return d >= cutoff ? d : max(d, (*this->b)(p, cutoff));
+  }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
+  SDF_NODE(Intersection)
 };
 struct SmoothUnion : Sdf {
   template <typename... Args>
@@ -246,7 +765,13 @@ struct SmoothUnion : Sdf {
     Float h = max(radius - abs(d1 - d2), 0.0f);
     return min(d1, d2) - h * h * 0.25 / radius;
   }
+  // The blend weighs the children's values by weights in [0, 1] that sum to
+  // 1, so it falls no faster than they do.
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
   Float radius;
+  SDF_NODE(SmoothUnion)
 };
 struct SmoothSubtraction : Sdf {
   template <typename... Args>
@@ -260,7 +785,11 @@ struct SmoothSubtraction : Sdf {
     Float h = max(radius - abs(-d1 - d2), 0.0f);
     return max(-d1, d2) + h * h * 0.25f / radius;
   }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return max(this->a->lipschitz_along(d), this->b->rate_from(p, d));
+  }
   Float radius;
+  SDF_NODE(SmoothSubtraction)
 };
 struct SmoothIntersection : Sdf {
   template <typename... Args>
@@ -274,7 +803,11 @@ struct SmoothIntersection : Sdf {
     Float h = max(radius - abs(d1 - d2), 0.0f);
     return max(d1, d2) + h * h * 0.25 / radius;
   }
+  inline Float local_rate_from(const Vec3 &p, const Vec3 &d) const override {
+    return children_rate_from(p, d);
+  }
   Float radius;
+  SDF_NODE(SmoothIntersection)
 };
 
 SDF_GEN(Sphere);
@@ -286,12 +819,22 @@ SDF_GEN(Pyramid);
 
 SDF_GEN(MengerSponge);
 SDF_GEN(SerpinskiTetrahedron);
+SDF_GEN(Kifs);
+SDF_GEN(Mandelbulb);
+SDF_GEN(Mandelbox);
 
 SDF_GEN(Elongate);
 SDF_GEN(Round);
 SDF_GEN(Onion);
 
+SDF_GEN(Repeat);
+SDF_GEN(LimitedRepeat);
+SDF_GEN(Mirror);
+SDF_GEN(PolarRepeat);
+SDF_GEN(Instance);
+
 SDF_GEN(Union);
+SDF_GEN(MultiUnion);
 SDF_GEN(Subtraction);
 SDF_GEN(Intersection);
 
@@ -16,6 +16,33 @@ struct RenderSettings {
   std::size_t spp = 0;
   bool no_bar = false;
   std::string output_fmt = "";
+  std::size_t png_level = 6;
+  std::size_t stream_rows = 0;
+  std::size_t checkpoint_interval = 0;
+  bool resume = false;
+  bool sax_loader = false;
+  bool optimize = false;
+  bool segment_tracing = false;
+  std::size_t refine_steps = 0;
+  bool analytic = false;
+  Float lod = 0.0f;
+  std::size_t seed = 0;
+  bool prepass = false;
+  std::size_t prepass_scale = 8;
+  std::size_t tiles = 0;
+  std::string affinity = "";
+  bool replicate = false;
+  bool first_touch = false;
+  bool scaling = false;
+  std::string isa = "";
+  bool fast_math = false;
+
+  std::size_t farm_workers = 0;
+  std::size_t farm_tiles = 0;
+  std::size_t farm_retries = 2;
+  std::size_t farm_timeout = 0;
+  std::string spool_dir = "";
+  std::string worker_spool = "";
 
   Float inter_pixel_arc = 0.0f;
 };